@@ -0,0 +1,237 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_ATOM_H_
+#define _OBJECT_ATOM_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "tcl.h"
+#include "Numeric.h"
+
+/*
+ * Interned policy literals.
+ *
+ * Every string literal in a policy is interned in the AtomTable when the
+ * policy is loaded, so a literal used by a thousand predicates is stored
+ * once.  An Atom is a String (its bytes stored inline behind it, as with
+ * String::literal) that also carries its hash and its first and last
+ * eight bytes as words.  Matching a subject against an Atom rejects on
+ * length, then on the head word, then on the tail word; for literals of
+ * 8 to 16 bytes those two words are the whole comparison, and only longer
+ * literals compare the middle bytes.
+ *
+ * The subject's hash is not cached: String has no spare bits once it is
+ * embedded in a Field, and the head/tail words reject as quickly without
+ * hashing the subject at all.
+ */
+
+namespace Service {
+
+    class Atom : public String {
+        Atom() : String() { }
+    public:
+        Atom *next;
+        uint32_t hash;
+        uint64_t head;
+        uint64_t tail;
+
+        static uint32_t hashOf( const char *s, uint32_t length ) {
+            uint32_t h = 2166136261u;
+            for ( uint32_t i = 0 ; i < length ; i++ ) {
+                h ^= (uint8_t)s[i];
+                h *= 16777619u;
+            }
+            return h;
+        }
+
+        static Atom *create( Pool *pool, const char *s, uint32_t bytes, uint32_t h ) {
+            void *block = String::operator new( sizeof(Atom) + bytes + 1, pool );
+            Atom *atom = ::new (block) Atom();
+            char *d = (char *)(atom + 1);
+            memcpy( d, s, bytes );
+            d[bytes] = '\0';
+            atom->start = d;
+            atom->length = bytes;
+            atom->value = 0;
+            atom->next = 0;
+            atom->hash = h;
+            atom->head = atom->tail = 0;
+            if ( bytes >= 8 ) {
+                atom->head = Numeric::load8( d );
+                atom->tail = Numeric::load8( d + bytes - 8 );
+            }
+            return atom;
+        }
+
+        /*
+         * True if the first length bytes of s are this atom.
+         */
+        bool prefixOf( const char *s ) const {
+            if ( length < 8 ) {
+                for ( uint32_t i = 0 ; i < length ; i++ ) {
+                    if ( s[i] != start[i] ) return false;
+                }
+                return true;
+            }
+            if ( Numeric::load8(s) != head ) return false;
+            if ( Numeric::load8(s + length - 8) != tail ) return false;
+            if ( length <= 16 ) return true;
+            return memcmp( s + 8, start + 8, length - 16 ) == 0;
+        }
+        bool matches( String *subject ) const {
+            if ( subject->start == 0 ) return false;
+            if ( subject->length != length ) return false;
+            return prefixOf( subject->start );
+        }
+        bool prefixes( String *subject ) const {
+            if ( subject->start == 0 ) return false;
+            if ( subject->length < length ) return false;
+            return prefixOf( subject->start );
+        }
+    };
+
+    /*
+     * Open hashed, chained by Atom::next.  Interning only happens while
+     * a policy is being built, so the table is not locked; lookups after
+     * that are read only.
+     */
+    class AtomTable {
+        Pool *pool;
+        Atom **bucket;
+        uint32_t buckets;       // power of two
+        uint32_t count;
+
+        void grow() {
+            uint32_t size = buckets * 2;
+            Atom **grown = (Atom **)calloc( size, sizeof(Atom *) );
+            for ( uint32_t i = 0 ; i < buckets ; i++ ) {
+                Atom *atom = bucket[i];
+                while ( atom ) {
+                    Atom *next = atom->next;
+                    uint32_t j = atom->hash & (size - 1);
+                    atom->next = grown[j];
+                    grown[j] = atom;
+                    atom = next;
+                }
+            }
+            free( bucket );
+            bucket = grown;
+            buckets = size;
+        }
+    public:
+        AtomTable( Pool *pool )
+        : pool(pool), buckets(64), count(0) {
+            bucket = (Atom **)calloc( buckets, sizeof(Atom *) );
+        }
+        ~AtomTable() { free( bucket ); }
+
+        Atom *find( const char *s, uint32_t length, uint32_t h ) const {
+            for ( Atom *atom = bucket[h & (buckets - 1)] ; atom ; atom = atom->next ) {
+                if ( atom->hash != h || atom->length != length ) continue;
+                if ( atom->prefixOf(s) ) return atom;
+            }
+            return 0;
+        }
+        Atom *find( const char *s, uint32_t length ) const {
+            return find( s, length, Atom::hashOf(s, length) );
+        }
+
+        Atom *intern( const char *s, uint32_t length ) {
+            uint32_t h = Atom::hashOf( s, length );
+            Atom *atom = find( s, length, h );
+            if ( atom ) return atom;
+            if ( count >= buckets ) grow();
+            atom = Atom::create( pool, s, length, h );
+            uint32_t i = h & (buckets - 1);
+            atom->next = bucket[i];
+            bucket[i] = atom;
+            count++;
+            return atom;
+        }
+        Atom *intern( const char *s ) { return intern( s, strlen(s) ); }
+        Atom *intern( String *s ) { return intern( s->start, s->length ); }
+
+        uint32_t size() const { return count; }
+    };
+
+    /*
+     * String predicates against an interned literal.  The atom belongs
+     * to the AtomTable and is not destroyed with the predicate.
+     */
+    class s_eq_r_a : public Predicate {
+        StringCoercion *lhs;
+        Atom *rhs;
+    public:
+        s_eq_r_a( StringCoercion *lhs, Atom *rhs ) : lhs(lhs), rhs(rhs) { }
+        virtual ~s_eq_r_a() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "Predicate::s_eq_r_a: destroy" );
+            lhs->destroy( pool );
+            Predicate::destroy( pool );
+        }
+        virtual void depends( Dependencies& d ) { lhs->depends( d ); }
+        virtual bool operator() ( Context *context ) {
+            return rhs->matches( (*lhs)(context) );
+        }
+    };
+    class s_ne_r_a : public Predicate {
+        StringCoercion *lhs;
+        Atom *rhs;
+    public:
+        s_ne_r_a( StringCoercion *lhs, Atom *rhs ) : lhs(lhs), rhs(rhs) { }
+        virtual ~s_ne_r_a() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "Predicate::s_ne_r_a: destroy" );
+            lhs->destroy( pool );
+            Predicate::destroy( pool );
+        }
+        virtual void depends( Dependencies& d ) { lhs->depends( d ); }
+        virtual bool operator() ( Context *context ) {
+            String *s = (*lhs)( context );
+            if ( s->start == 0 ) return false;
+            return rhs->matches( s ) == false;
+        }
+    };
+    class s_prefix_r_a : public Predicate {
+        StringCoercion *lhs;
+        Atom *rhs;
+    public:
+        s_prefix_r_a( StringCoercion *lhs, Atom *rhs ) : lhs(lhs), rhs(rhs) { }
+        virtual ~s_prefix_r_a() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "Predicate::s_prefix_r_a: destroy" );
+            lhs->destroy( pool );
+            Predicate::destroy( pool );
+        }
+        virtual void depends( Dependencies& d ) { lhs->depends( d ); }
+        virtual bool operator() ( Context *context ) {
+            return rhs->prefixes( (*lhs)(context) );
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
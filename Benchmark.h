@@ -0,0 +1,159 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_BENCHMARK_H_
+#define _OBJECT_BENCHMARK_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * A small self contained benchmark harness.
+ *
+ * Each Case registers itself at static construction time.  run() grows
+ * the iteration count until a case takes at least 200ms, then reports
+ * ns/op along with cycles, instructions and cache misses per op read
+ * from perf_event_open().  Counters the kernel refuses (no PMU, or
+ * perf_event_paranoid) are reported as "-".
+ */
+
+namespace Service {
+    namespace Benchmark {
+
+        class Counter {
+            int fd;
+        public:
+            Counter( uint32_t type, uint64_t config ) : fd(-1) {
+                struct perf_event_attr attr;
+                memset( &attr, 0, sizeof(attr) );
+                attr.size = sizeof(attr);
+                attr.type = type;
+                attr.config = config;
+                attr.disabled = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fd = syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+            }
+            ~Counter() { if ( fd >= 0 ) close( fd ); }
+            bool valid() const { return fd >= 0; }
+            void start() {
+                if ( fd < 0 ) return;
+                ioctl( fd, PERF_EVENT_IOC_RESET, 0 );
+                ioctl( fd, PERF_EVENT_IOC_ENABLE, 0 );
+            }
+            uint64_t stop() {
+                uint64_t value = 0;
+                if ( fd < 0 ) return 0;
+                ioctl( fd, PERF_EVENT_IOC_DISABLE, 0 );
+                if ( read(fd, &value, sizeof(value)) != sizeof(value) ) return 0;
+                return value;
+            }
+        };
+
+        inline uint64_t now() {
+            struct timespec ts;
+            clock_gettime( CLOCK_MONOTONIC, &ts );
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+
+        /*
+         * Results of the measured operation are folded into sink so the
+         * compiler cannot discard the work being timed.
+         */
+        extern volatile uint64_t sink;
+
+        class Case {
+        public:
+            const char *name;
+            Case *next;
+            static Case *&list() {
+                static Case *cases = 0;
+                return cases;
+            }
+            Case( const char *name ) : name(name), next(0) {
+                Case **tail = &list();
+                while ( *tail ) tail = &(*tail)->next;
+                *tail = this;
+            }
+            virtual ~Case() {}
+            virtual void setup() { }
+            virtual void operator () ( uint64_t iterations ) = 0;
+        };
+
+        inline void report( const char *name, uint64_t n, uint64_t ns,
+                            Counter& cycles, uint64_t c,
+                            Counter& instructions, uint64_t i,
+                            Counter& misses, uint64_t m ) {
+            printf( "%-40s %12llu %10.2f", name, (unsigned long long)n, (double)ns / n );
+            if ( cycles.valid() )       printf( " %10.2f", (double)c / n );
+            else                        printf( " %10s", "-" );
+            if ( instructions.valid() ) printf( " %10.2f", (double)i / n );
+            else                        printf( " %10s", "-" );
+            if ( misses.valid() )       printf( " %10.4f", (double)m / n );
+            else                        printf( " %10s", "-" );
+            printf( "\n" );
+        }
+
+        /*
+         * Run every registered case whose name contains filter (all of
+         * them when filter is NULL).
+         */
+        inline int run( const char *filter ) {
+            Counter cycles( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES );
+            Counter instructions( PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS );
+            Counter misses( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES );
+
+            printf( "%-40s %12s %10s %10s %10s %10s\n",
+                    "benchmark", "iterations", "ns/op", "cycles/op", "insns/op", "misses/op" );
+            for ( Case *bench = Case::list() ; bench ; bench = bench->next ) {
+                if ( filter && strstr(bench->name, filter) == 0 ) continue;
+                bench->setup();
+                (*bench)( 1000 );   // warm caches and branch predictors
+
+                uint64_t n = 1000, elapsed = 0;
+                uint64_t c = 0, i = 0, m = 0;
+                for (;;) {
+                    uint64_t begin = now();
+                    cycles.start(); instructions.start(); misses.start();
+                    (*bench)( n );
+                    m = misses.stop(); i = instructions.stop(); c = cycles.stop();
+                    elapsed = now() - begin;
+                    if ( elapsed >= 200000000ULL || n >= (1ULL << 34) ) break;
+                    n *= ( elapsed < 20000000ULL ) ? 10 : 2;
+                }
+                report( bench->name, n, elapsed, cycles, c, instructions, i, misses, m );
+            }
+            return 0;
+        }
+    }
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
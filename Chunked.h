@@ -0,0 +1,233 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_CHUNKED_H_
+#define _OBJECT_CHUNKED_H_
+
+#include <stdint.h>
+#include <cstring>
+#include <sys/uio.h>
+#include "tcl.h"
+#include "Scan.h"
+#include "Numeric.h"
+
+/*
+ * Incremental decoder for chunked transfer coding.
+ *
+ * feed() takes whatever the last read returned and describes the payload
+ * it contains as iovec spans pointing into that buffer; nothing is
+ * copied except trailer lines, which are kept so they can be exposed as
+ * Fields once the body is complete.  Framing state carries over between
+ * calls, so a fragment may end anywhere, including in the middle of a
+ * chunk size line.
+ *
+ * chunk describes the most recent chunk header: value is its size
+ * (saturated to 32 bits, see Numeric::saturate) and count the number of
+ * chunks seen.  trailer[0..trailers) are the trailer lines, each a Field
+ * over "Name: value" without the line terminator; lines past TRAILERS
+ * are not kept and are counted in dropped.  Chunk sizes go through
+ * Numeric::hexadecimal.
+ */
+
+namespace Service {
+
+    class ChunkedDecoder {
+    public:
+        enum Status { MORE, DONE, ERROR };
+
+        static const uint32_t TRAILERS = 16;
+        static const uint32_t TRAILERBYTES = 2048;
+
+        Field chunk;
+        Field trailer[TRAILERS];
+        uint32_t trailers;
+        uint32_t dropped;
+
+    private:
+        enum State {
+            SIZE, EXTENSION, SIZE_LF,
+            DATA, DATA_CR, DATA_LF,
+            TRAILER, TRAILER_LINE, TRAILER_LF,
+            FINISHED, FAILED
+        };
+        State state;
+        uint64_t size;
+        uint64_t remaining;
+        uint32_t digits;
+        char store[TRAILERBYTES];
+        uint32_t stored;
+        uint32_t line;
+
+        static bool hex( char c ) {
+            if ( c >= '0' && c <= '9' ) return true;
+            c |= 0x20;
+            return c >= 'a' && c <= 'f';
+        }
+
+        void sized() {
+            chunk.value = Numeric::saturate( size );
+            chunk.count++;
+            remaining = size;
+            state = ( size == 0 ) ? TRAILER : DATA;
+        }
+
+    public:
+        ChunkedDecoder() { reset(); }
+        ~ChunkedDecoder() {}
+
+        void reset() {
+            ClearFields( 1, &chunk );
+            ClearFields( TRAILERS, trailer );
+            trailers = 0;
+            dropped = 0;
+            state = SIZE;
+            size = remaining = 0;
+            digits = 0;
+            stored = 0;
+            line = 0;
+        }
+
+        Status status() const {
+            if ( state == FINISHED ) return DONE;
+            if ( state == FAILED ) return ERROR;
+            return MORE;
+        }
+
+        /*
+         * Payload bytes still owed by the current chunk.
+         */
+        uint64_t pending() const { return ( state == DATA ) ? remaining : 0; }
+
+        /*
+         * Decode length bytes at buffer.  Payload spans are appended to
+         * iov, at most max of them, and their number returned in *spans.
+         * Returns the number of bytes consumed, which is less than length
+         * when iov fills up or the body ends; the caller feeds the rest
+         * again (or hands it to the next message once status() is DONE).
+         */
+        uint32_t feed( char *buffer, uint32_t length, struct iovec *iov, uint32_t max, uint32_t *spans ) {
+            char *s = buffer, *end = buffer + length;
+            *spans = 0;
+            while ( s < end ) {
+                switch ( state ) {
+                case SIZE: {
+                    if ( hex(*s) ) {
+                        // the size line may be split across feeds
+                        uint64_t value;
+                        uint32_t n = Numeric::hexadecimal( s, end - s, &value );
+                        if ( n == 0 ) { state = FAILED; break; }        // over 64 bits
+                        bool overflow = ( n >= 16 ) ? size != 0 : ( size >> (64 - 4 * n) ) != 0;
+                        if ( overflow ) { state = FAILED; break; }
+                        size = ( n >= 16 ) ? value : ( (size << (4 * n)) | value );
+                        digits += n;
+                        s += n;
+                        break;
+                    }
+                    if ( digits == 0 ) { state = FAILED; break; }
+                    if ( *s == '\r' )      { state = SIZE_LF; s++; }
+                    else if ( *s == '\n' ) { s++; sized(); }
+                    else if ( *s == ';' || *s == ' ' || *s == '\t' ) { state = EXTENSION; s++; }
+                    else state = FAILED;
+                    break;
+                }
+                case EXTENSION: {
+                    // extensions are ignored, skip to the end of the line
+                    char *nl = Scan::find( s, end, '\n' );
+                    s = nl;
+                    if ( s < end ) { s++; sized(); }
+                    break;
+                }
+                case SIZE_LF:
+                    if ( *s != '\n' ) { state = FAILED; break; }
+                    s++;
+                    sized();
+                    break;
+                case DATA: {
+                    if ( *spans == max ) return s - buffer;
+                    uint64_t available = end - s;
+                    uint64_t take = ( remaining < available ) ? remaining : available;
+                    iov[*spans].iov_base = s;
+                    iov[*spans].iov_len = take;
+                    (*spans)++;
+                    s += take;
+                    remaining -= take;
+                    if ( remaining == 0 ) state = DATA_CR;
+                    break;
+                }
+                case DATA_CR:
+                    if ( *s == '\r' )      { state = DATA_LF; s++; }
+                    else if ( *s == '\n' ) { state = SIZE; size = 0; digits = 0; s++; }
+                    else state = FAILED;
+                    break;
+                case DATA_LF:
+                    if ( *s != '\n' ) { state = FAILED; break; }
+                    s++;
+                    state = SIZE;
+                    size = 0;
+                    digits = 0;
+                    break;
+                case TRAILER:
+                    if ( *s == '\r' )      { state = TRAILER_LF; s++; }
+                    else if ( *s == '\n' ) { state = FINISHED; s++; }
+                    else                   { state = TRAILER_LINE; line = stored; }
+                    break;
+                case TRAILER_LINE: {
+                    char *nl = Scan::find( s, end, '\n' );
+                    uint32_t n = nl - s;
+                    if ( stored + n > TRAILERBYTES ) { state = FAILED; break; }
+                    memcpy( store + stored, s, n );
+                    stored += n;
+                    s = nl;
+                    if ( s == end ) break;
+                    s++;
+                    uint32_t length = stored - line;
+                    if ( length > 0 && store[stored - 1] == '\r' ) length--;
+                    if ( trailers < TRAILERS ) {
+                        Field& f = trailer[trailers++];
+                        f.start = store + line;
+                        f.length = length;
+                        f.end = store + line + length;
+                        f.count = 1;
+                    } else {
+                        dropped++;
+                    }
+                    state = TRAILER;
+                    break;
+                }
+                case TRAILER_LF:
+                    if ( *s != '\n' ) { state = FAILED; break; }
+                    s++;
+                    state = FINISHED;
+                    break;
+                case FINISHED:
+                case FAILED:
+                    return s - buffer;
+                }
+            }
+            return s - buffer;
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
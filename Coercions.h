@@ -28,6 +28,7 @@
 #include <cstdlib>
 #include "tcl.h"
 #include "crc32.h"
+#include "Dependencies.h"
 
 namespace Service {
 
@@ -38,6 +39,19 @@ namespace Service {
         virtual void destroy(Pool *);
         void * operator new ( std::size_t, Pool * );
         void operator delete ( void * ) {}
+        virtual void depends( Dependencies& d ) { d.unknown(); }
+
+        /*
+         * Two coercions with the same kind and identity compute the
+         * same value; kind 0 means only the object itself qualifies.
+         */
+        virtual const void *identity( uint32_t *kind ) { *kind = 0; return this; }
+        static bool equivalent( IntegerCoercion *a, IntegerCoercion *b ) {
+            uint32_t ka, kb;
+            const void *ia = a->identity( &ka );
+            const void *ib = b->identity( &kb );
+            return ka == kb && ia == ib;
+        }
     };
 
     class StringCoercion {
@@ -47,6 +61,7 @@ namespace Service {
         void * operator new ( std::size_t, Pool * );
         void operator delete ( void * ) {}
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { d.unknown(); }
     };
 
     class IntegerIdentity : public IntegerCoercion {
@@ -58,6 +73,7 @@ namespace Service {
         virtual uint32_t operator() ( Context *context ) {
             return value;
         }
+        virtual void depends( Dependencies& d ) { }
     };
 
     class StringLength : public IntegerCoercion {
@@ -68,6 +84,7 @@ namespace Service {
         virtual ~StringLength() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() (Context *);
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
     };
 
     class FieldLength : public IntegerCoercion {
@@ -79,6 +96,8 @@ namespace Service {
         virtual uint32_t operator() ( Context *context ) {
             return dr->length;
         }
+        virtual void depends( Dependencies& d ) { d.add( dr ); }
+        virtual const void *identity( uint32_t *kind ) { *kind = 2; return dr; }
     };
 
     class FieldValue : public IntegerCoercion {
@@ -91,6 +110,8 @@ namespace Service {
             if ( dr->count == 0 ) return 0;
             return dr->value;
         }
+        virtual void depends( Dependencies& d ) { d.add( dr ); }
+        virtual const void *identity( uint32_t *kind ) { *kind = 1; return dr; }
     };
 
     class FieldCRC32 : public IntegerCoercion {
@@ -102,6 +123,7 @@ namespace Service {
         virtual ~FieldCRC32() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() (Context *);
+        virtual void depends( Dependencies& d ) { input->depends( d ); }
     };
 
     class IntegerFork : public IntegerCoercion {
@@ -121,6 +143,11 @@ namespace Service {
         virtual ~IntegerFork() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() (Context *);
+        virtual void depends( Dependencies& d ) {
+            predicate->depends( d );
+            trueClause->depends( d );
+            falseClause->depends( d );
+        }
     };
 
     class StringIdentity : public StringCoercion {
@@ -130,6 +157,7 @@ namespace Service {
         virtual ~StringIdentity() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { }
     };
 
     class FieldString : public StringCoercion {
@@ -139,6 +167,7 @@ namespace Service {
         virtual ~FieldString() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { d.add( dr ); }
     };
 
     class hexdecode : public StringCoercion {
@@ -154,6 +183,7 @@ namespace Service {
         virtual ~hexdecode() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { input->depends( d ); }
     };
 
     class s_lowercase : public StringCoercion {
@@ -168,6 +198,7 @@ namespace Service {
         virtual ~s_lowercase() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { input->depends( d ); }
     };
 
     class s_date : public StringCoercion {
@@ -184,6 +215,7 @@ namespace Service {
         virtual ~s_date() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
 
     class StringFork : public StringCoercion {
@@ -203,6 +235,11 @@ namespace Service {
         virtual ~StringFork() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) {
+            predicate->depends( d );
+            trueClause->depends( d );
+            falseClause->depends( d );
+        }
     
     };
 
@@ -211,6 +248,8 @@ namespace Service {
         virtual ~ClientAddress() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() ( Context * );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
+        virtual const void *identity( uint32_t *kind ) { *kind = 3; return 0; }
     };
 
     bool Initialize( Tcl_Interp *, OPE * );
@@ -0,0 +1,285 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_COMPILE_H_
+#define _OBJECT_COMPILE_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <pthread.h>
+#include "tcl.h"
+#include "GlobFilter.h"
+
+/*
+ * Parallel policy compilation.
+ *
+ * Initialize() walks the Tcl policy definitions on the interpreter thread
+ * (a Tcl_Interp may not be shared between threads).  Anything expensive
+ * and independent of the rest of the tree is queued as a Job instead of
+ * being built in place.  In this tree that is the Glob automata; address
+ * prefixes and literals cost less to build than to hand to a thread.
+ * Pipeline::run() compiles the queued jobs on a small work-stealing pool,
+ * each worker allocating from its own Pool, and then calls link() on
+ * every job in submission order on the calling thread so the result can
+ * be stitched into the Predicate/Verb tree.
+ *
+ * Every job is submitted before run(), so a worker that finds nothing to
+ * pop or steal is done and exits; no worker waits for another.
+ *
+ * A job that cannot be queued or compiled is marked failed: it is not
+ * linked, its slot stays NULL and run() returns false.
+ *
+ * The Pools handed to the pipeline must live as long as the objects
+ * compiled into them.
+ */
+
+namespace Service {
+    namespace Compile {
+
+        class Job {
+        public:
+            Job *next;
+            bool failed;
+            Job() : next(0), failed(false) { }
+            virtual ~Job() {}
+            virtual void operator () ( Pool * ) = 0;
+            virtual void link() { }
+            void * operator new ( std::size_t, Pool * );
+            void operator delete ( void * ) {}
+        };
+
+        class GlobJob : public Job {
+            const char *pattern;
+            Glob **slot;
+        public:
+            GlobJob( const char *pattern, Glob **slot )
+            : pattern(pattern), slot(slot) { *slot = 0; }
+            virtual ~GlobJob() {}
+            virtual void operator () ( Pool *pool ) {
+                *slot = new (pool) Glob( pool, pattern );
+                if ( *slot == 0 ) failed = true;
+            }
+        };
+
+        /*
+         * A GlobMatches predicate whose automaton is compiled by a
+         * worker.  link() builds the predicate itself, from into, and
+         * stores it in slot; the Glob stays in the worker's Pool.
+         */
+        class GlobMatchesJob : public Job {
+            class Linked : public GlobMatches {
+            public:
+                Linked( StringCoercion *coercion, Glob *glob, const char *pattern, bool caseless )
+                : GlobMatches(coercion, glob, GlobFilter(pattern, caseless), caseless) { }
+                virtual ~Linked() {}
+            };
+            Pool *into;
+            StringCoercion *coercion;
+            const char *pattern;
+            bool caseless;
+            Glob *glob;
+            Predicate **slot;
+        public:
+            GlobMatchesJob( Pool *into, StringCoercion *coercion, const char *pattern,
+                            uint32_t flags, Predicate **slot )
+            : into(into), coercion(coercion), pattern(pattern),
+              caseless( (flags & GlobMatches::CASELESS) != 0 ), glob(0), slot(slot) { *slot = 0; }
+            virtual ~GlobMatchesJob() {}
+            virtual void operator () ( Pool *pool ) {
+                glob = GlobMatches::compile( pool, pattern, caseless );
+                if ( glob == 0 ) failed = true;
+            }
+            virtual void link() {
+                if ( glob == 0 ) {
+                    failed = true;
+                    return;
+                }
+                *slot = new (into) Linked( coercion, glob, pattern, caseless );
+                if ( *slot == 0 ) failed = true;
+            }
+        };
+
+        /*
+         * A mutex protected deque of jobs.  The owner pushes and pops at
+         * the tail, thieves take from the head so they get the oldest (and
+         * usually largest) remaining work.
+         */
+        class Deque {
+            pthread_mutex_t lock;
+            Job **ring;
+            uint32_t capacity;
+            uint32_t head;
+            uint32_t tail;
+        public:
+            Deque() : ring(0), capacity(0), head(0), tail(0) {
+                pthread_mutex_init( &lock, NULL );
+            }
+            ~Deque() {
+                pthread_mutex_destroy( &lock );
+                if ( ring ) free( ring );
+            }
+            /*
+             * False if the deque could not grow; the job is not queued.
+             */
+            bool push( Job *job ) {
+                pthread_mutex_lock( &lock );
+                if ( tail - head == capacity ) {
+                    uint32_t size = capacity ? capacity * 2 : 64;
+                    Job **grown = (Job **)malloc( size * sizeof(Job *) );
+                    if ( grown == 0 ) {
+                        pthread_mutex_unlock( &lock );
+                        return false;
+                    }
+                    for ( uint32_t i = 0 ; i < tail - head ; i++ ) {
+                        grown[i] = ring[(head + i) % capacity];
+                    }
+                    if ( ring ) free( ring );
+                    tail -= head;
+                    head = 0;
+                    ring = grown;
+                    capacity = size;
+                }
+                ring[tail % capacity] = job;
+                tail++;
+                pthread_mutex_unlock( &lock );
+                return true;
+            }
+            Job *pop() {
+                Job *job = 0;
+                pthread_mutex_lock( &lock );
+                if ( tail != head ) job = ring[--tail % capacity];
+                pthread_mutex_unlock( &lock );
+                return job;
+            }
+            Job *steal() {
+                Job *job = 0;
+                pthread_mutex_lock( &lock );
+                if ( tail != head ) job = ring[head++ % capacity];
+                pthread_mutex_unlock( &lock );
+                return job;
+            }
+        };
+
+        class Pipeline {
+            struct Worker {
+                Pipeline *pipeline;
+                uint32_t index;
+                Pool *pool;
+                Deque queue;
+                pthread_t thread;
+            };
+
+            Worker *workers;
+            uint32_t count;
+            uint32_t submitted;
+            Job *first;
+            Job *last;
+
+            Job *next( uint32_t index ) {
+                Job *job = workers[index].queue.pop();
+                if ( job ) return job;
+                for ( uint32_t i = 1 ; i < count ; i++ ) {
+                    job = workers[(index + i) % count].queue.steal();
+                    if ( job ) return job;
+                }
+                return 0;
+            }
+            void work( uint32_t index ) {
+                Pool *pool = workers[index].pool;
+                Job *job;
+                while ( (job = next(index)) != 0 ) (*job)( pool );
+            }
+            static void *worker( void *arg ) {
+                Worker *self = (Worker *)arg;
+                self->pipeline->work( self->index );
+                return 0;
+            }
+        public:
+            /*
+             * One worker per Pool.  pools[0] is used by the thread that
+             * calls run(), which takes part in the compile.
+             */
+            Pipeline( uint32_t count, Pool **pools )
+            : count(count ? count : 1), submitted(0),
+              first(0), last(0) {
+                workers = new Worker[this->count];
+                for ( uint32_t i = 0 ; i < this->count ; i++ ) {
+                    workers[i].pipeline = this;
+                    workers[i].index = i;
+                    workers[i].pool = pools[i];
+                }
+            }
+            ~Pipeline() { delete [] workers; }
+
+            /*
+             * Queue a job.  False if no worker could take it, in which
+             * case the job is marked failed.
+             */
+            bool submit( Job *job ) {
+                job->next = 0;
+                if ( last ) last->next = job;
+                else        first = job;
+                last = job;
+                for ( uint32_t i = 0 ; i < count ; i++ ) {
+                    if ( workers[submitted++ % count].queue.push(job) ) return true;
+                }
+                UINFO( 1, "Compile::Pipeline: cannot queue job" << endl );
+                job->failed = true;
+                return false;
+            }
+
+            /*
+             * Compile every submitted job, then link them in submission
+             * order.  Returns false if a worker thread could not be
+             * started, in which case the jobs are still all compiled on
+             * the threads that did start, or if a job failed.
+             */
+            bool run() {
+                bool result = true;
+                uint32_t started = 1;
+                for ( uint32_t i = 1 ; i < count ; i++ ) {
+                    if ( pthread_create(&workers[i].thread, NULL, worker, &workers[i]) != 0 ) {
+                        UINFO( 1, "Compile::Pipeline: failed to start worker " << i << endl );
+                        result = false;
+                        break;
+                    }
+                    started++;
+                }
+                work( 0 );
+                for ( uint32_t i = 1 ; i < started ; i++ ) {
+                    pthread_join( workers[i].thread, NULL );
+                }
+                for ( Job *job = first ; job ; job = job->next ) {
+                    if ( job->failed == false ) job->link();
+                    if ( job->failed ) result = false;
+                }
+                first = last = 0;
+                submitted = 0;
+                return result;
+            }
+        };
+    }
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
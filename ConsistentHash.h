@@ -0,0 +1,182 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_CONSISTENTHASH_H_
+#define _OBJECT_CONSISTENTHASH_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include "tcl.h"
+#include "Trace.h"
+
+/*
+ * Consistent backend selection for stickyVariable.
+ *
+ * A Maglev lookup table is built per backend pool: every backend fills
+ * table slots in the order of its own permutation of the table, taking
+ * turns, until the table is full.  Selecting a backend is then a hash of
+ * the sticky value and one table load, and adding or removing one of N
+ * backends moves only about 1/N of the keys.  Tables are immutable once
+ * built; ConsistentHash swaps in a new one atomically when membership
+ * changes and hands the old one back to be freed after a grace period.
+ *
+ * jump() is the table free alternative for pools that only ever grow or
+ * shrink at the end.
+ */
+
+namespace Service {
+
+    class Maglev {
+    public:
+        static const uint32_t SIZE = 65537;     // prime, at least 100 * BACKENDS
+        static const uint16_t EMPTY = 0xffff;
+        static const uint32_t BACKENDS = SIZE / 100;    // keeps load within about 1% of even
+
+        uint32_t backends;
+        uint32_t generation;
+        bool failed;
+        uint16_t entry[SIZE];
+
+        static uint32_t mix( uint32_t h ) {
+            h ^= h >> 16;
+            h *= 0x85ebca6b;
+            h ^= h >> 13;
+            h *= 0xc2b2ae35;
+            h ^= h >> 16;
+            return h;
+        }
+
+        static uint32_t hash( const char *s, uint32_t seed ) {
+            uint32_t h = 2166136261u ^ seed;
+            while ( *s ) {
+                h ^= (uint8_t)*s++;
+                h *= 16777619u;
+            }
+            return mix( h );
+        }
+
+        /*
+         * names identifies the backends, so a backend keeps its slots
+         * across rebuilds as long as its name does not change.  At most
+         * BACKENDS backends; with more, or if memory runs out, the table
+         * is built empty and valid() is false.
+         */
+        Maglev( const char **names, uint32_t count, uint32_t generation )
+        : backends(count), generation(generation), failed(false) {
+            memset( entry, 0xff, sizeof(entry) );
+            if ( count == 0 ) return;
+            if ( count > BACKENDS ) {
+                UTRACE2( 1, "Maglev: too many backends, limit", count, BACKENDS );
+                backends = 0;
+                failed = true;
+                return;
+            }
+            uint32_t *offset = (uint32_t *)malloc( count * sizeof(uint32_t) );
+            uint32_t *skip = (uint32_t *)malloc( count * sizeof(uint32_t) );
+            uint32_t *next = (uint32_t *)calloc( count, sizeof(uint32_t) );
+            if ( offset == 0 || skip == 0 || next == 0 ) {
+                UTRACE( 1, "Maglev: out of memory" );
+                free( offset );
+                free( skip );
+                free( next );
+                backends = 0;
+                failed = true;
+                return;
+            }
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                offset[i] = hash( names[i], 0x9e3779b9 ) % SIZE;
+                skip[i] = hash( names[i], 0x7f4a7c15 ) % (SIZE - 1) + 1;
+            }
+            uint32_t filled = 0;
+            while ( filled < SIZE ) {
+                for ( uint32_t i = 0 ; i < count && filled < SIZE ; i++ ) {
+                    uint32_t slot;
+                    do {
+                        slot = (uint32_t)( (offset[i] + (uint64_t)next[i] * skip[i]) % SIZE );
+                        next[i]++;
+                    } while ( entry[slot] != EMPTY );
+                    entry[slot] = i;
+                    filled++;
+                }
+            }
+            free( offset );
+            free( skip );
+            free( next );
+        }
+        ~Maglev() {}
+
+        /*
+         * False if the backends asked for could not be placed.
+         */
+        bool valid() const { return failed == false; }
+
+        /*
+         * Backend index for a sticky value, or EMPTY for an empty pool.
+         */
+        uint32_t lookup( uint32_t key ) const {
+            uint32_t h = mix( key );
+            return entry[ (uint32_t)(((uint64_t)h * SIZE) >> 32) ];
+        }
+    };
+
+    /*
+     * Lamping and Veach's jump consistent hash.
+     */
+    inline int32_t jump( uint64_t key, int32_t buckets ) {
+        int64_t b = -1, j = 0;
+        while ( j < buckets ) {
+            b = j;
+            key = key * 2862933555777941757ULL + 1;
+            j = (int64_t)( (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)) );
+        }
+        return (int32_t)b;
+    }
+
+    class ConsistentHash {
+        Maglev * volatile table;
+    public:
+        ConsistentHash() : table(0) { }
+        ~ConsistentHash() { delete table; }
+
+        /*
+         * Install a new table.  Returns the previous one, which readers
+         * may still be using; free it once they are known to be done.
+         */
+        Maglev *swap( Maglev *fresh ) {
+            __sync_synchronize();
+            return __sync_lock_test_and_set( &table, fresh );
+        }
+
+        Maglev *current() const { return table; }
+
+        uint32_t lookup( uint32_t key ) const {
+            Maglev *t = table;
+            if ( t == 0 ) return Maglev::EMPTY;
+            return t->lookup( key );
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
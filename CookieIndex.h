@@ -0,0 +1,283 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_COOKIEINDEX_H_
+#define _OBJECT_COOKIEINDEX_H_
+
+#include <stdint.h>
+#include <cstring>
+#include "tcl.h"
+#include "Scan.h"
+
+/*
+ * Per request index of the Cookie header.
+ *
+ * The first lookup splits the header once, on ';' and '=', into name
+ * and value spans and files them in a small open addressed table keyed
+ * by a hash of the name.  Later lookups -- from cookiePersist's
+ * persistence policy or from CookieValue coercions -- are a hash probe
+ * and one compare.  Values are Fields over the original header bytes,
+ * nothing is copied.  reset() must be called for every new message.
+ *
+ * Only the first COOKIES names are indexed.  On a larger header the
+ * index remembers where it stopped, and a name it does not hold is
+ * looked for by a linear scan of the rest of the header.  The Field a
+ * scan returns is one of OVERFLOW scratch Fields, reused round robin.
+ */
+
+namespace Service {
+
+    class CookieIndex {
+    public:
+        static const uint32_t COOKIES = 64;
+        static const uint32_t SLOTS = 128;      // power of two, 2 * COOKIES
+        static const uint32_t OVERFLOW = 8;
+
+        static uint32_t hash( const char *s, uint32_t length ) {
+            uint32_t h = 2166136261u;
+            for ( uint32_t i = 0 ; i < length ; i++ ) {
+                h ^= (uint8_t)s[i];
+                h *= 16777619u;
+            }
+            return h;
+        }
+
+    private:
+        struct Cookie {
+            char *name;
+            uint32_t length;
+            uint32_t hash;
+        };
+
+        Field *header;
+        bool indexed;
+        uint32_t count;
+        char *rest;                     // first cookie not indexed, or NULL
+        uint32_t overflows;
+        Cookie cookie[COOKIES];
+        Field value[COOKIES];
+        Field overflow[OVERFLOW];
+        uint8_t slot[SLOTS];            // cookie index + 1, 0 is empty
+
+        static bool space( char c ) { return c == ' ' || c == '\t'; }
+
+        /*
+         * Split the cookie in [s, semi) into name and value.  False if
+         * it has no '='.
+         */
+        static bool split( char *s, char *semi, char **name, uint32_t *nameLength,
+                           char **v, uint32_t *valueLength ) {
+            char *a = s, *b = semi;
+            while ( a < b && space(*a) ) a++;
+            while ( b > a && space(b[-1]) ) b--;
+            char *eq = (char *)memchr( a, '=', b - a );
+            if ( eq == 0 ) return false;
+            char *ne = eq;
+            while ( ne > a && space(ne[-1]) ) ne--;
+            char *value = eq + 1;
+            while ( value < b && space(*value) ) value++;
+            *name = a;
+            *nameLength = ne - a;
+            *v = value;
+            *valueLength = b - value;
+            return true;
+        }
+
+        void fill( Field& f, char *v, uint32_t valueLength ) {
+            if ( valueLength >= 2 && v[0] == '"' && v[valueLength-1] == '"' ) {
+                v++;
+                valueLength -= 2;
+            }
+            f.start = v;
+            f.length = valueLength;
+            f.end = v + valueLength;
+            f.count = 1;
+            f.value = 0;
+            f.parent = header;
+        }
+
+        /*
+         * False if the index is full and the cookie was not added.
+         */
+        bool add( char *name, uint32_t nameLength, char *v, uint32_t valueLength ) {
+            if ( nameLength == 0 ) return true;
+            uint32_t h = hash( name, nameLength );
+            uint32_t i = h & (SLOTS - 1);
+            while ( slot[i] ) {
+                Cookie& c = cookie[slot[i] - 1];
+                // first occurrence of a name wins, as browsers send the most specific first
+                if ( c.hash == h && c.length == nameLength && memcmp(c.name, name, nameLength) == 0 ) return true;
+                i = (i + 1) & (SLOTS - 1);
+            }
+            if ( count == COOKIES ) return false;
+            Cookie& c = cookie[count];
+            c.name = name;
+            c.length = nameLength;
+            c.hash = h;
+            fill( value[count], v, valueLength );
+            count++;
+            slot[i] = count;
+            return true;
+        }
+
+        void index() {
+            indexed = true;
+            if ( header == 0 || header->count == 0 ) return;
+            char *s = header->start;
+            char *end = s + header->length;
+            while ( s < end ) {
+                char *semi = Scan::find( s, end, ';' );
+                char *name, *v;
+                uint32_t nameLength, valueLength;
+                if ( split(s, semi, &name, &nameLength, &v, &valueLength) ) {
+                    if ( add(name, nameLength, v, valueLength) == false ) {
+                        rest = s;
+                        return;
+                    }
+                }
+                if ( semi == end ) break;
+                s = semi + 1;
+            }
+        }
+
+        /*
+         * First occurrence of name past the indexed cookies.
+         */
+        Field *scan( const char *name, uint32_t length ) {
+            char *s = rest;
+            char *end = header->start + header->length;
+            while ( s < end ) {
+                char *semi = Scan::find( s, end, ';' );
+                char *n, *v;
+                uint32_t nameLength, valueLength;
+                if ( split(s, semi, &n, &nameLength, &v, &valueLength) &&
+                     nameLength == length && memcmp(n, name, length) == 0 ) {
+                    Field& f = overflow[overflows++ % OVERFLOW];
+                    fill( f, v, valueLength );
+                    return &f;
+                }
+                if ( semi == end ) break;
+                s = semi + 1;
+            }
+            return 0;
+        }
+
+    public:
+        /*
+         * cookieHeader is the Program's Cookie Field.  Given here, it is
+         * what CookieValue reports to Dependencies; reset() still names
+         * the header for each message.
+         */
+        CookieIndex( Field *cookieHeader = 0 )
+        : header(cookieHeader), indexed(false), count(0), rest(0), overflows(0) {
+            memset( slot, 0, sizeof(slot) );
+        }
+        ~CookieIndex() {}
+
+        Field *field() const { return header; }
+
+        void reset( Field *cookieHeader ) {
+            header = cookieHeader;
+            if ( indexed ) memset( slot, 0, sizeof(slot) );
+            indexed = false;
+            count = 0;
+            rest = 0;
+        }
+
+        /*
+         * The header had more than COOKIES cookies.
+         */
+        bool truncated() {
+            if ( indexed == false ) index();
+            return rest != 0;
+        }
+
+        uint32_t size() {
+            if ( indexed == false ) index();
+            return count;
+        }
+
+        /*
+         * The value of a cookie, or NULL if it is not present.  hash must
+         * be CookieIndex::hash( name, length ).
+         */
+        Field *lookup( const char *name, uint32_t length, uint32_t h ) {
+            if ( indexed == false ) index();
+            uint32_t i = h & (SLOTS - 1);
+            while ( slot[i] ) {
+                uint32_t n = slot[i] - 1;
+                Cookie& c = cookie[n];
+                if ( c.hash == h && c.length == length && memcmp(c.name, name, length) == 0 ) {
+                    return &value[n];
+                }
+                i = (i + 1) & (SLOTS - 1);
+            }
+            if ( rest ) return scan( name, length );
+            return 0;
+        }
+        Field *lookup( const char *name, uint32_t length ) {
+            return lookup( name, length, hash(name, length) );
+        }
+    };
+
+    /*
+     * The value of a named cookie, or an empty String (count 0) when it
+     * is absent, so present/absent and the s_* predicates work on it.
+     * name is not copied: it belongs to the caller, normally the policy
+     * Pool, and must outlive the coercion.  The result depends only on
+     * the Cookie header, which is what depends() reports, so cookie keyed
+     * rules can be memoized; an index built without its header Field
+     * reports unknown().
+     */
+    class CookieValue : public StringCoercion {
+        CookieIndex *cookies;
+        char *name;
+        uint32_t length;
+        uint32_t hash;
+        String missing;
+    public:
+        CookieValue( CookieIndex *cookies, char *name )
+        : cookies(cookies), name(name), length(strlen(name)),
+          hash(CookieIndex::hash(name, length)) { }
+        virtual ~CookieValue() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "StringCoercion::CookieValue: destroy" );
+            StringCoercion::destroy( pool );
+        }
+        virtual void depends( Dependencies& d ) {
+            if ( cookies->field() == 0 ) {
+                d.unknown();
+                return;
+            }
+            d.add( cookies->field() );
+        }
+        virtual String * operator() ( Context *context ) {
+            Field *f = cookies->lookup( name, length, hash );
+            if ( f == 0 ) return &missing;
+            return f;
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,251 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_DECISIONCACHE_H_
+#define _OBJECT_DECISIONCACHE_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include "tcl.h"
+#include "Dependencies.h"
+
+/*
+ * Memoized Cond selection.
+ *
+ * For most requests the branch a Cond takes is decided by a handful of
+ * Fields -- the method, the Host, a path prefix, a cookie.  CachedCond
+ * runs Dependencies over its selection predicates once, at construction,
+ * and from then on builds a key from its own address and those Fields'
+ * contents (count, value, length and bytes), looks the key up in a
+ * DecisionCache and, on
+ * a hit, runs the remembered block without evaluating any predicate.
+ * The blocks themselves always run, so their side effects on the
+ * Context happen exactly as they would without the cache.
+ *
+ * A CachedCond whose predicates are not completely understood, read
+ * anything that is not a Field (ClientAddress, s_date, AddressMatches,
+ * ...) or act on the Context (ConnectionInsert, SetCookieInsert, ...,
+ * which a hit would skip), never uses its cache and behaves exactly
+ * like Cond.  So does a
+ * request whose key is longer than DecisionCache::KEY.  Because the key
+ * starts with the CachedCond's address, several Conds may share one
+ * DecisionCache without seeing each other's selections.
+ *
+ * The cache is sharded by the top bits of the key hash; each shard is a
+ * fixed, direct mapped array of slots, so memory is bounded and a new
+ * key simply replaces whatever was in its slot.  Slots are guarded by a
+ * sequence number: a writer makes it odd with a compare-and-swap, fills
+ * the slot and makes it even again; a reader that sees an odd or a
+ * changed sequence treats the lookup as a miss.  No locks are taken,
+ * and lookups write nothing, so the slot array stays shared clean
+ * across cores.
+ */
+
+namespace Service {
+
+    class DecisionCache {
+    public:
+        static const uint32_t KEY = 108;
+        static const uint32_t SHARDS = 16;
+        static const int32_t MISS = -1;
+    private:
+        struct Slot {
+            volatile uint32_t sequence;
+            int32_t decision;
+            uint64_t hash;
+            uint32_t length;
+            char key[KEY];
+        };
+        Slot *slot;
+        uint32_t slots;             // per shard, power of two
+        uint32_t mask;
+
+        Slot& locate( uint64_t hash ) {
+            uint32_t shard = (uint32_t)(hash >> 60) & (SHARDS - 1);
+            return slot[ shard * slots + ((uint32_t)hash & mask) ];
+        }
+    public:
+        /*
+         * slots is rounded up to a power of two.
+         */
+        DecisionCache( uint32_t perShard = 256 ) {
+            slots = 1;
+            while ( slots < perShard ) slots <<= 1;
+            mask = slots - 1;
+            slot = (Slot *)calloc( SHARDS * slots, sizeof(Slot) );
+            if ( slot == 0 ) {
+                UTRACE( 0, "DecisionCache: could not allocate slots" );
+                slots = 0;
+                mask = 0;
+            }
+        }
+        ~DecisionCache() { if ( slot ) free( slot ); }
+        bool valid() const { return slot != 0; }
+
+        static uint64_t hash( const char *key, uint32_t length ) {
+            uint64_t h = 14695981039346656037ULL;
+            for ( uint32_t i = 0 ; i < length ; i++ ) {
+                h ^= (uint8_t)key[i];
+                h *= 1099511628211ULL;
+            }
+            return h;
+        }
+
+        int32_t lookup( uint64_t hash, const char *key, uint32_t length ) {
+            Slot& s = locate( hash );
+            uint32_t sequence = s.sequence;
+            if ( sequence & 1 ) return MISS;
+            __sync_synchronize();
+            int32_t decision = s.decision;
+            bool same = s.hash == hash && s.length == length &&
+                        memcmp( s.key, key, length ) == 0;
+            __sync_synchronize();
+            if ( same == false || s.sequence != sequence ) return MISS;
+            return decision;
+        }
+
+        void store( uint64_t hash, const char *key, uint32_t length, int32_t decision ) {
+            Slot& s = locate( hash );
+            uint32_t sequence = s.sequence;
+            if ( sequence & 1 ) return;
+            if ( __sync_bool_compare_and_swap(&s.sequence, sequence, sequence + 1) == false ) return;
+            s.hash = hash;
+            s.length = length;
+            memcpy( s.key, key, length );
+            s.decision = decision;
+            __sync_synchronize();
+            s.sequence = sequence + 2;
+        }
+
+        void clear() {
+            for ( uint32_t i = 0 ; i < SHARDS * slots ; i++ ) {
+                uint32_t sequence = slot[i].sequence;
+                if ( sequence & 1 ) continue;
+                if ( __sync_bool_compare_and_swap(&slot[i].sequence, sequence, sequence + 1) == false ) continue;
+                slot[i].length = 0;
+                slot[i].hash = 0;
+                slot[i].decision = MISS;
+                __sync_synchronize();
+                slot[i].sequence = sequence + 2;
+            }
+        }
+    };
+
+    class CachedCond : public Verb {
+        Selection *selection;
+        DecisionCache *cache;
+        Field **field;
+        uint32_t fields;
+        bool cacheable;
+
+        /*
+         * The key for the current message, or false if it does not fit.
+         */
+        bool key( char *buffer, uint32_t *length ) {
+            CachedCond *self = this;
+            memcpy( buffer, &self, sizeof(self) );
+            uint32_t n = sizeof(self);
+            for ( uint32_t i = 0 ; i < fields ; i++ ) {
+                Field *f = field[i];
+                uint32_t bytes = f->count ? f->length : 0;
+                if ( n + 10 + bytes > DecisionCache::KEY ) return false;
+                memcpy( buffer + n, &f->count, 2 );
+                memcpy( buffer + n + 2, &f->value, 4 );
+                memcpy( buffer + n + 6, &bytes, 4 );
+                if ( bytes ) memcpy( buffer + n + 10, f->start, bytes );
+                n += 10 + bytes;
+            }
+            *length = n;
+            return true;
+        }
+        int32_t evaluate( Context& context ) {
+            int32_t index = 0;
+            for ( Selection *s = selection ; s ; s = s->next, index++ ) {
+                if ( (*s->predicate)(&context) ) return index;
+            }
+            return index;           // none matched
+        }
+        Verb *block( int32_t index ) {
+            Selection *s = selection;
+            while ( s && index-- > 0 ) s = s->next;
+            return s ? s->block : 0;
+        }
+    public:
+        CachedCond( Selection *selection, Verb *next, DecisionCache *cache )
+        : Verb(next), selection(selection), cache(cache),
+          field(0), fields(0), cacheable(false) {
+            Dependencies d;
+            for ( Selection *s = selection ; s ; s = s->next ) {
+                s->predicate->depends( d );
+            }
+            if ( cache == 0 || cache->valid() == false || d.cacheable() == false ) {
+                UTRACE( 3, "CachedCond: selection is not cacheable" );
+                return;
+            }
+            field = (Field **)malloc( (d.size() ? d.size() : 1) * sizeof(Field *) );
+            if ( field == 0 ) {
+                UTRACE( 0, "CachedCond: could not allocate field list" );
+                return;
+            }
+            fields = d.size();
+            for ( uint32_t i = 0 ; i < fields ; i++ ) field[i] = d[i];
+            cacheable = true;
+        }
+        virtual ~CachedCond() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "Verb::CachedCond: destroy" );
+            if ( selection ) selection->destroy( pool );
+            if ( field ) free( field );
+            Verb::destroy( pool );
+        }
+        virtual void operator() ( Context& context ) {
+            int32_t index = DecisionCache::MISS;
+            char buffer[DecisionCache::KEY];
+            uint32_t length = 0;
+            uint64_t h = 0;
+            bool keyed = cacheable && key( buffer, &length );
+            if ( keyed ) {
+                h = DecisionCache::hash( buffer, length );
+                index = cache->lookup( h, buffer, length );
+            }
+            if ( index == DecisionCache::MISS ) {
+                index = evaluate( context );
+                if ( keyed ) cache->store( h, buffer, length, index );
+            }
+            Verb *chosen = block( index );
+            if ( chosen ) (*chosen)( context );
+            if ( next ) (*next)( context );
+        }
+        virtual void depends( Dependencies& d ) {
+            for ( Selection *s = selection ; s ; s = s->next ) {
+                s->predicate->depends( d );
+                s->block->depends( d );
+            }
+            if ( next ) next->depends( d );
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
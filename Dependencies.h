@@ -0,0 +1,110 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_DEPENDENCIES_H_
+#define _OBJECT_DEPENDENCIES_H_
+
+#include <stdint.h>
+#include <cstdlib>
+
+/*
+ * The Fields a policy can read.
+ *
+ * Every Predicate, coercion and Verb reports what it reads through
+ * depends(): Field coercions add their Field, combinators recurse into
+ * their operands.  The base class implementations call unknown(), so a
+ * node the analysis does not understand makes the result incomplete and
+ * the caller falls back to parsing and clearing everything.  Nodes that
+ * read something other than Fields mark the set uncacheable().
+ *
+ * Program::depends() adds the Program's own slots (Connection,
+ * Content-Length, the version, ...) and the parent of every Field in
+ * the set, so a header is parsed whenever one of its sub-fields is
+ * needed.  The analysis runs once, after the policy is loaded.
+ */
+
+namespace Service {
+    class Field;
+
+    class Dependencies {
+        Field **field;
+        uint32_t count;
+        uint32_t capacity;
+        bool opaque;
+        bool varying;
+    public:
+        Dependencies()
+        : field(0), count(0), capacity(0), opaque(false), varying(false) { }
+        ~Dependencies() { if ( field ) free( field ); }
+
+        void add( Field *f ) {
+            if ( f == 0 || contains(f) ) return;
+            if ( count == capacity ) {
+                capacity = capacity ? capacity * 2 : 32;
+                field = (Field **)realloc( field, capacity * sizeof(Field *) );
+            }
+            field[count++] = f;
+        }
+        bool contains( Field *f ) const {
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                if ( field[i] == f ) return true;
+            }
+            return false;
+        }
+
+        void unknown() { opaque = true; }
+        bool complete() const { return opaque == false; }
+
+        /*
+         * Set by nodes whose result is not a function of the Fields --
+         * the client address, the clock, per-connection state -- and by
+         * nodes that act on the Context (queue header edits), so a
+         * decision that reaches them must not be memoized or skipped.
+         */
+        void uncacheable() { varying = true; }
+        bool cacheable() const { return opaque == false && varying == false; }
+
+        uint32_t size() const { return count; }
+        Field *operator [] ( uint32_t i ) const { return field[i]; }
+
+        /*
+         * One bit per Field of a parser's Field array: set if the Field
+         * must be parsed.  Every bit is set when the set is incomplete.
+         */
+        template <class F>
+        void mark( F *base, uint32_t fields, uint8_t *bits ) const {
+            uint32_t bytes = (fields + 7) / 8;
+            for ( uint32_t i = 0 ; i < bytes ; i++ ) bits[i] = opaque ? 0xff : 0;
+            if ( opaque ) return;
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                if ( field[i] < base || field[i] >= base + fields ) continue;
+                uint32_t n = field[i] - base;
+                bits[n >> 3] |= 1 << (n & 7);
+            }
+        }
+        void reset() { count = 0; opaque = false; varying = false; }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,250 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_EDITPLAN_H_
+#define _OBJECT_EDITPLAN_H_
+
+#include <stdint.h>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "tcl.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+ * Header rewriting without rebuilding the header block.
+ *
+ * An EditPlan records deletions as byte ranges of the original receive
+ * buffer and insertions as small fragments anchored at a position in
+ * it.  emit() turns the plan into an iovec that interleaves the untouched
+ * parts of the buffer with the inserted fragments, ready for writev() or
+ * sendmsg(); the original bytes are never copied.  This is what the
+ * ConnectionDelete, ConnectionInsert, SetCookieInsert and SSLCipherInsert
+ * decisions are applied through.
+ *
+ * Inserted text is copied into the plan's own arena unless the caller
+ * passes a fragment that outlives the plan (a literal, or a String held
+ * by the policy).  An insertion anchored strictly inside a deleted range
+ * is dropped along with the text it was anchored to.
+ */
+
+namespace Service {
+
+    class EditPlan {
+    public:
+        static const uint32_t EDITS = 32;
+        static const uint32_t ARENA = 1024;
+
+    private:
+        struct Edit {
+            char *from;         // deletion start, or insertion point
+            char *to;           // deletion end, equal to from for an insertion
+            const char *text;
+            uint32_t length;
+            uint32_t order;     // keeps insertions at one point in call order
+        };
+
+        char *buffer;
+        char *end;
+        Edit edits[EDITS];
+        uint32_t count;
+        char arena[ARENA];
+        uint32_t used;
+
+        bool add( char *from, char *to, const char *text, uint32_t length ) {
+            if ( count == EDITS ) return false;
+            if ( from < buffer || to > end || from > to ) return false;
+            Edit& e = edits[count];
+            e.from = from;
+            e.to = to;
+            e.text = text;
+            e.length = length;
+            e.order = count;
+            count++;
+            return true;
+        }
+
+        static bool before( const Edit& a, const Edit& b ) {
+            if ( a.from != b.from ) return a.from < b.from;
+            return a.order < b.order;
+        }
+
+    public:
+        EditPlan( char *buffer, uint32_t length )
+        : buffer(buffer), end(buffer + length), count(0), used(0) { }
+        ~EditPlan() {}
+
+        void reset( char *buffer, uint32_t length ) {
+            this->buffer = buffer;
+            this->end = buffer + length;
+            count = 0;
+            used = 0;
+        }
+
+        bool empty() const { return count == 0; }
+
+        bool remove( char *from, char *to ) {
+            return add( from, to, 0, 0 );
+        }
+
+        /*
+         * Delete the whole header line a Field was parsed from, including
+         * its line terminator.
+         */
+        bool remove( Field *field ) {
+            if ( field == 0 || field->count == 0 ) return false;
+            char *from = field->start;
+            while ( from > buffer && from[-1] != '\n' ) from--;
+            char *to = field->start + field->length;
+            while ( to < end && *to != '\n' ) to++;
+            if ( to < end ) to++;
+            return remove( from, to );
+        }
+
+        /*
+         * Insert text at a position in the buffer.  copy = false keeps a
+         * pointer to text, which must then outlive the plan.
+         */
+        bool insert( char *at, const char *text, uint32_t length, bool copy ) {
+            if ( copy ) {
+                if ( used + length > ARENA ) return false;
+                memcpy( arena + used, text, length );
+                text = arena + used;
+                used += length;
+            }
+            return add( at, at, text, length );
+        }
+
+        /*
+         * Insert a complete header line ("Name: value\r\n") just before
+         * the empty line that ends the header block.
+         */
+        bool insertHeader( Field *EoH, const char *line, uint32_t length, bool copy ) {
+            if ( EoH == 0 || EoH->count == 0 ) return false;
+            return insert( EoH->start, line, length, copy );
+        }
+
+        /*
+         * Both edits or neither: room for two is checked up front.
+         */
+        bool replace( Field *field, const char *text, uint32_t length, bool copy ) {
+            if ( field == 0 || field->count == 0 ) return false;
+            char *from = field->start;
+            char *to = field->start + field->length;
+            if ( count + 2 > EDITS ) return false;
+            if ( from < buffer || to > end ) return false;
+            if ( insert(from, text, length, copy) == false ) return false;
+            return remove( from, to );
+        }
+
+        /*
+         * Fill iov with the rewritten message.  Returns the number of
+         * entries used, or -1 if max is too small.  *total receives the
+         * number of bytes described.
+         */
+        int emit( struct iovec *iov, uint32_t max, size_t *total ) {
+            // few edits, an insertion sort is all that is needed
+            for ( uint32_t i = 1 ; i < count ; i++ ) {
+                Edit e = edits[i];
+                uint32_t j = i;
+                while ( j > 0 && before(e, edits[j-1]) ) {
+                    edits[j] = edits[j-1];
+                    j--;
+                }
+                edits[j] = e;
+            }
+
+            uint32_t n = 0;
+            size_t bytes = 0;
+            char *cursor = buffer;
+            bool deleted[EDITS];
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                Edit& e = edits[i];
+                deleted[i] = false;
+                if ( e.from != e.to ) continue;
+                for ( uint32_t j = 0 ; j < count ; j++ ) {
+                    if ( edits[j].from < e.from && e.from < edits[j].to ) deleted[i] = true;
+                }
+            }
+            for ( uint32_t i = 0 ; i <= count ; i++ ) {
+                char *stop = ( i < count ) ? edits[i].from : end;
+                if ( stop > cursor ) {
+                    if ( n == max ) return -1;
+                    iov[n].iov_base = cursor;
+                    iov[n].iov_len = stop - cursor;
+                    bytes += iov[n].iov_len;
+                    n++;
+                    cursor = stop;
+                }
+                if ( i == count ) break;
+                Edit& e = edits[i];
+                if ( e.length > 0 && deleted[i] == false ) {
+                    if ( n == max ) return -1;
+                    iov[n].iov_base = (void *)e.text;
+                    iov[n].iov_len = e.length;
+                    bytes += e.length;
+                    n++;
+                }
+                // overlapping deletions simply extend the skipped range
+                if ( e.to > cursor ) cursor = e.to;
+            }
+            *total = bytes;
+            return n;
+        }
+
+        /*
+         * writev() the whole iovec, resuming after partial writes, at
+         * most IOV_MAX entries per call.  Returns false on error, with
+         * errno set; on EAGAIN *iov and *count are left describing what
+         * is still to be sent.
+         */
+        static bool send( int fd, struct iovec **iov, int *count ) {
+            while ( *count > 0 ) {
+                int batch = ( *count < IOV_MAX ) ? *count : IOV_MAX;
+                ssize_t n = writev( fd, *iov, batch );
+                if ( n < 0 ) {
+                    if ( errno == EINTR ) continue;
+                    return false;
+                }
+                while ( *count > 0 && (size_t)n >= (*iov)->iov_len ) {
+                    n -= (*iov)->iov_len;
+                    (*iov)++;
+                    (*count)--;
+                }
+                if ( *count > 0 ) {
+                    (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+                    (*iov)->iov_len -= n;
+                }
+            }
+            return true;
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,193 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_FIELDTABLE_H_
+#define _OBJECT_FIELDTABLE_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include "tcl.h"
+
+/*
+ * Structure of arrays alternative to an array of Field.
+ *
+ * Evaluation only reads start, length, value and count, so those are
+ * kept in parallel dense arrays packed into one cache line aligned
+ * block; the parse state (end, parent, parser, processor) lives in a
+ * separate cold array.  A table of 32 fields keeps all of its hot state
+ * in 9 cache lines and ClearFields() is a single memset of the block.
+ *
+ * A table whose allocation failed has size() zero and is not valid();
+ * the caller must not use it.
+ *
+ * FieldTableLength, FieldTableValue and FieldTableString are the table
+ * equivalents of FieldLength, FieldValue and FieldString; present and
+ * absent work unchanged on top of FieldTableString.
+ */
+
+namespace Service {
+
+    class FieldTable {
+    public:
+        struct Cold {
+            char *end;
+            Field *parent;
+            Parse::Procedure *parser;
+            Parse::Processor *processor;
+        };
+
+        char    **start;
+        uint32_t *length;
+        uint32_t *value;
+        uint16_t *count;
+        Cold     *cold;
+
+    private:
+        uint32_t capacity;
+        uint32_t bytes;
+        void *block;
+
+    public:
+        FieldTable( uint32_t fields )
+        : start(0), length(0), value(0), count(0), cold(0),
+          capacity((fields + 7) & ~7), bytes(0), block(0) {
+            bytes = capacity * ( sizeof(char *) + 2 * sizeof(uint32_t) + sizeof(uint16_t) );
+            bytes = (bytes + 63) & ~63;
+            if ( posix_memalign(&block, 64, bytes) != 0 ) block = 0;
+            cold = (Cold *)calloc( capacity ? capacity : 1, sizeof(Cold) );
+            if ( block == 0 || cold == 0 ) {
+                UTRACE( 1, "FieldTable: out of memory" );
+                free( block );
+                free( cold );
+                block = 0;
+                cold = 0;
+                capacity = 0;
+                bytes = 0;
+                return;
+            }
+            memset( block, 0, bytes );
+            start  = (char **)block;
+            length = (uint32_t *)(start + capacity);
+            value  = length + capacity;
+            count  = (uint16_t *)(value + capacity);
+        }
+        ~FieldTable() {
+            free( block );
+            free( cold );
+        }
+
+        bool valid() const { return block != 0; }
+        uint32_t size() const { return capacity; }
+
+        void clear() { if ( block ) memset( block, 0, bytes ); }
+
+        void set( uint32_t i, char *s, uint32_t n ) {
+            start[i] = s;
+            length[i] = n;
+            count[i]++;
+        }
+
+        void load( uint32_t i, Field *f ) const {
+            f->start = start[i];
+            f->length = length[i];
+            f->value = value[i];
+            f->count = count[i];
+            f->end = cold[i].end;
+            f->parent = cold[i].parent;
+            f->parser = cold[i].parser;
+            f->processor = cold[i].processor;
+        }
+        void store( uint32_t i, Field *f ) {
+            start[i] = f->start;
+            length[i] = f->length;
+            value[i] = f->value;
+            count[i] = f->count;
+            cold[i].end = f->end;
+            cold[i].parent = f->parent;
+            cold[i].parser = f->parser;
+            cold[i].processor = f->processor;
+        }
+    };
+
+    inline void ClearFields( FieldTable& table ) {
+        table.clear();
+    }
+
+    class FieldTableLength : public IntegerCoercion {
+        FieldTable *table;
+        uint32_t index;
+    public:
+        FieldTableLength( FieldTable *table, uint32_t index )
+        : table(table), index(index) { }
+        virtual ~FieldTableLength() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "IntegerCoercion::FieldTableLength: destroy" );
+            IntegerCoercion::destroy( pool );
+        }
+        virtual uint32_t operator() ( Context *context ) {
+            return table->length[index];
+        }
+    };
+
+    class FieldTableValue : public IntegerCoercion {
+        FieldTable *table;
+        uint32_t index;
+    public:
+        FieldTableValue( FieldTable *table, uint32_t index )
+        : table(table), index(index) { }
+        virtual ~FieldTableValue() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "IntegerCoercion::FieldTableValue: destroy" );
+            IntegerCoercion::destroy( pool );
+        }
+        virtual uint32_t operator() ( Context *context ) {
+            if ( table->count[index] == 0 ) return 0;
+            return table->value[index];
+        }
+    };
+
+    class FieldTableString : public StringCoercion {
+        FieldTable *table;
+        uint32_t index;
+        String annotation;
+    public:
+        FieldTableString( FieldTable *table, uint32_t index )
+        : table(table), index(index) { }
+        virtual ~FieldTableString() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "StringCoercion::FieldTableString: destroy" );
+            StringCoercion::destroy( pool );
+        }
+        virtual String * operator() ( Context *context ) {
+            annotation.start = table->start[index];
+            annotation.length = table->length[index];
+            annotation.value = table->value[index];
+            annotation.count = table->count[index];
+            return &annotation;
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -28,9 +28,12 @@
 #include <cstdlib>
 #include "tcl.h"
 #include "crc32.h"
+#include "Trace.h"
+#include "Dependencies.h"
 
 namespace Service {
 
+    class IntegerCoercion;
     class Predicate {
     public:
         virtual ~Predicate() {}
@@ -38,6 +41,16 @@ namespace Service {
         void * operator new ( std::size_t, Pool * );
         void operator delete ( void * ) {}
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { d.unknown(); }
+
+        /*
+         * True if this predicate holds exactly when coercion's value is
+         * in [lo, hi); coercion 0 means any coercion.  Used to turn Cond
+         * chains of range tests into an IntervalCond.
+         */
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            return false;
+        }
     };
     class AnnotatedPredicate {
     public:
@@ -156,6 +169,19 @@ namespace Service {
         virtual void destroy(Pool *);
         void * operator new ( std::size_t, Pool * );
         void operator delete ( void * ) {}
+        virtual void depends( Dependencies& d ) { d.unknown(); }
+
+        /*
+         * Two coercions with the same kind and identity compute the
+         * same value; kind 0 means only the object itself qualifies.
+         */
+        virtual const void *identity( uint32_t *kind ) { *kind = 0; return this; }
+        static bool equivalent( IntegerCoercion *a, IntegerCoercion *b ) {
+            uint32_t ka, kb;
+            const void *ia = a->identity( &ka );
+            const void *ib = b->identity( &kb );
+            return ka == kb && ia == ib;
+        }
     };
     class StringCoercion {
     public:
@@ -164,6 +190,7 @@ namespace Service {
         void * operator new ( std::size_t, Pool * );
         void operator delete ( void * ) {}
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { d.unknown(); }
     };
     
     class IntegerIdentity : public IntegerCoercion {
@@ -175,6 +202,7 @@ namespace Service {
         virtual uint32_t operator() ( Context *context ) {
             return value;
         }
+        virtual void depends( Dependencies& d ) { }
     };
     class StringLength : public IntegerCoercion {
         StringCoercion *coercion;
@@ -184,6 +212,7 @@ namespace Service {
         virtual ~StringLength() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() (Context *);
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
     };
     class FieldLength : public IntegerCoercion {
         Field *dr;
@@ -194,6 +223,8 @@ namespace Service {
         virtual uint32_t operator() ( Context *context ) {
             return dr->length;
         }
+        virtual void depends( Dependencies& d ) { d.add( dr ); }
+        virtual const void *identity( uint32_t *kind ) { *kind = 2; return dr; }
     };
     class FieldValue : public IntegerCoercion {
         Field *dr;
@@ -205,6 +236,8 @@ namespace Service {
             if ( dr->count == 0 ) return 0;
             return dr->value;
         }
+        virtual void depends( Dependencies& d ) { d.add( dr ); }
+        virtual const void *identity( uint32_t *kind ) { *kind = 1; return dr; }
     };
     class FieldCRC32 : public IntegerCoercion {
         StringCoercion *input;
@@ -215,6 +248,7 @@ namespace Service {
         virtual ~FieldCRC32() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() (Context *);
+        virtual void depends( Dependencies& d ) { input->depends( d ); }
     };
     class IntegerFork : public IntegerCoercion {
         Predicate *predicate;
@@ -233,6 +267,11 @@ namespace Service {
         virtual ~IntegerFork() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() (Context *);
+        virtual void depends( Dependencies& d ) {
+            predicate->depends( d );
+            trueClause->depends( d );
+            falseClause->depends( d );
+        }
     };
     class StringIdentity : public StringCoercion {
         String *value;
@@ -241,6 +280,7 @@ namespace Service {
         virtual ~StringIdentity() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { }
     };
     class FieldString : public StringCoercion {
         Field *dr;
@@ -249,6 +289,7 @@ namespace Service {
         virtual ~FieldString() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { d.add( dr ); }
     };
     class hexdecode : public StringCoercion {
         StringCoercion *input;
@@ -263,6 +304,7 @@ namespace Service {
         virtual ~hexdecode() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { input->depends( d ); }
     };
     class s_lowercase : public StringCoercion {
         StringCoercion *input;
@@ -276,6 +318,7 @@ namespace Service {
         virtual ~s_lowercase() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { input->depends( d ); }
     };
     class s_date : public StringCoercion {
         uint32_t delta;
@@ -291,6 +334,7 @@ namespace Service {
         virtual ~s_date() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     class StringFork : public StringCoercion {
         Predicate *predicate;
@@ -309,6 +353,11 @@ namespace Service {
         virtual ~StringFork() {}
         virtual void destroy(Pool *);
         virtual String * operator() (Context *);
+        virtual void depends( Dependencies& d ) {
+            predicate->depends( d );
+            trueClause->depends( d );
+            falseClause->depends( d );
+        }
     
     };
     class ClientAddress : public IntegerCoercion {
@@ -316,6 +365,8 @@ namespace Service {
         virtual ~ClientAddress() {}
         virtual void destroy(Pool *);
         virtual uint32_t operator() ( Context * );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
+        virtual const void *identity( uint32_t *kind ) { *kind = 3; return 0; }
     };
     
     class T : public Predicate {
@@ -325,6 +376,13 @@ namespace Service {
         virtual void destroy(Pool *pool) {}
         virtual bool
         operator () ( Context *context ) { return true; }
+        virtual void depends( Dependencies& d ) { }
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            *coercion = 0;
+            *lo = 0;
+            *hi = 1ULL << 32;
+            return true;
+        }
     };
     class F : public Predicate {
     public:
@@ -333,6 +391,7 @@ namespace Service {
         virtual void destroy(Pool *pool) {}
         virtual bool
         operator () ( Context *context ) { return false; }
+        virtual void depends( Dependencies& d ) { }
     };
     class Matches : public Predicate {
         StringCoercion *ff;
@@ -343,6 +402,7 @@ namespace Service {
         virtual ~Matches() {}
         virtual bool operator() ( Context * );
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { ff->depends( d ); }
     };
     class present : public Predicate {
         StringCoercion *coercion;
@@ -351,6 +411,7 @@ namespace Service {
         virtual ~present() { }
         virtual bool operator() ( Context * ) ;
         virtual void destroy( Pool * );
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
     };
     class absent : public Predicate {
         StringCoercion *coercion;
@@ -359,438 +420,223 @@ namespace Service {
         virtual ~absent() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context * );
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
+    };
+    /*
+     * The comparison predicates.
+     *
+     * Compare<Op, Lhs, Rhs> is the whole family: Op is the relation, Lhs
+     * and Rhs say where each operand comes from -- a coercion register or
+     * an immediate -- and, for registers, the coercion's concrete type.
+     * When the concrete type is known the coercion is called with a
+     * qualified, non-virtual call, so FieldValue or FieldLength against
+     * an immediate compiles to a load and a compare with no virtual call
+     * inside the predicate.  The base coercion types fall back to the
+     * usual virtual call.  The historical i_*_r_* and s_*_r_* names are
+     * typedefs of the generic instantiations.
+     */
+    #if __cplusplus >= 201103L
+    #define COMPARE_FINAL final
+    #else
+    #define COMPARE_FINAL
+    #endif
+
+    template <class C = IntegerCoercion>
+    struct IntegerRegister {
+        typedef C *type;
+        static uint32_t value( C *c, Context *context ) {
+            return c->C::operator()( context );
+        }
+        static void destroy( C *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( C *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( C *c ) { return c; }
+        static bool constant( C *, uint32_t * ) { return false; }
+    };
+    template <>
+    struct IntegerRegister<IntegerCoercion> {
+        typedef IntegerCoercion *type;
+        static uint32_t value( IntegerCoercion *c, Context *context ) {
+            return (*c)( context );
+        }
+        static void destroy( IntegerCoercion *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( IntegerCoercion *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( IntegerCoercion *c ) { return c; }
+        static bool constant( IntegerCoercion *, uint32_t * ) { return false; }
+    };
+    struct IntegerImmediate {
+        typedef uint32_t type;
+        static uint32_t value( uint32_t v, Context * ) { return v; }
+        static void destroy( uint32_t, Pool * ) { }
+        static void depends( uint32_t, Dependencies& ) { }
+        static IntegerCoercion *integer( uint32_t ) { return 0; }
+        static bool constant( uint32_t v, uint32_t *k ) { *k = v; return true; }
     };
-    class i_eq_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_eq_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_eq_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_eq_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) == (*rhs)(context) );
-        }
-    };
-    class i_eq_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_eq_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_eq_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_eq_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) == rhs );
-        }
-    };
-    
-    class i_ne_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_ne_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ne_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_ne_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) != (*rhs)(context) );
-        }
-    };
-    class i_ne_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_ne_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ne_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_ne_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) != rhs );
-        }
-    };
-    
-    class i_lt_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_lt_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_lt_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_lt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) < (*rhs)(context) );
-        }
-    };
-    class i_lt_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_lt_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_lt_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_lt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) < rhs );
-        }
-    };
-    
-    class i_gt_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_gt_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_gt_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_gt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) > (*rhs)(context) );
-        }
-    };
-    class i_gt_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_gt_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_gt_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_gt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) > rhs );
-        }
-    };
-    
-    class i_le_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_le_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_le_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_le_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) <= (*rhs)(context) );
-        }
-    };
-    class i_le_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_le_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_le_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_le_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) <= rhs );
-        }
-    };
-    
-    class i_ge_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_ge_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ge_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_ge_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) >= (*rhs)(context) );
-        }
-    };
-    class i_ge_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_ge_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ge_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_ge_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) >= rhs );
-        }
-    };
-    
-    class s_eq_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_eq_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_eq_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_eq_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->eq(b) );
-        }
-    };
-    class s_eq_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_eq_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_eq_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_eq_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->eq(rhs) );
-        }
-    };
-    
-    class s_ne_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_ne_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ne_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ne_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->ne(b) );
-        }
-    };
-    class s_ne_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_ne_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ne_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ne_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->ne(rhs) );
-        }
-    };
-    
-    class s_lt_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_lt_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_lt_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_lt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->lt(b) );
-        }
-    };
-    class s_lt_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_lt_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_lt_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_lt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->lt(rhs) );
-        }
-    };
-    
-    class s_gt_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_gt_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_gt_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_gt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->gt(b) );
-        }
-    };
-    class s_gt_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_gt_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_gt_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_gt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->gt(rhs) );
-        }
-    };
-    
-    class s_le_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_le_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_le_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_le_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->le(b) );
-        }
+
+    template <class C = StringCoercion>
+    struct StringRegister {
+        typedef C *type;
+        static String *value( C *c, Context *context ) {
+            return c->C::operator()( context );
+        }
+        static void destroy( C *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( C *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( C * ) { return 0; }
+        static bool constant( C *, uint32_t * ) { return false; }
+    };
+    template <>
+    struct StringRegister<StringCoercion> {
+        typedef StringCoercion *type;
+        static String *value( StringCoercion *c, Context *context ) {
+            return (*c)( context );
+        }
+        static void destroy( StringCoercion *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( StringCoercion *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( StringCoercion * ) { return 0; }
+        static bool constant( StringCoercion *, uint32_t * ) { return false; }
+    };
+    struct StringImmediate {
+        typedef String *type;
+        static String *value( String *v, Context * ) { return v; }
+        static void destroy( String *v, Pool *pool ) {
+            if ( v ) v->destroy( pool );
+        }
+        static void depends( String *, Dependencies& ) { }
+        static IntegerCoercion *integer( String * ) { return 0; }
+        static bool constant( String *, uint32_t * ) { return false; }
     };
-    class s_le_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_le_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_le_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_le_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->le(rhs) );
+
+    struct EQ {
+        static bool test( uint32_t a, uint32_t b ) { return a == b; }
+        static bool test( String *a, String *b ) { return a->eq(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = k;
+            *hi = k + 1;
+            return true;
+        }
+    };
+    struct NE {
+        static bool test( uint32_t a, uint32_t b ) { return a != b; }
+        static bool test( String *a, String *b ) { return a->ne(b); }
+        static bool bounds( uint64_t, uint64_t *, uint64_t * ) { return false; }
+    };
+    struct LT {
+        static bool test( uint32_t a, uint32_t b ) { return a < b; }
+        static bool test( String *a, String *b ) { return a->lt(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = 0;
+            *hi = k;
+            return true;
+        }
+    };
+    struct GT {
+        static bool test( uint32_t a, uint32_t b ) { return a > b; }
+        static bool test( String *a, String *b ) { return a->gt(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = k + 1;
+            *hi = 1ULL << 32;
+            return true;
+        }
+    };
+    struct LE {
+        static bool test( uint32_t a, uint32_t b ) { return a <= b; }
+        static bool test( String *a, String *b ) { return a->le(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = 0;
+            *hi = k + 1;
+            return true;
+        }
+    };
+    struct GE {
+        static bool test( uint32_t a, uint32_t b ) { return a >= b; }
+        static bool test( String *a, String *b ) { return a->ge(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = k;
+            *hi = 1ULL << 32;
+            return true;
         }
     };
-    
-    class s_ge_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
+
+    template <class Op, class Lhs, class Rhs>
+    class Compare COMPARE_FINAL : public Predicate {
+        typename Lhs::type lhs;
+        typename Rhs::type rhs;
     public:
-        s_ge_r_r( StringCoercion *lhs, StringCoercion *rhs )
+        Compare( typename Lhs::type lhs, typename Rhs::type rhs )
         : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ge_r_r() {}
+        virtual ~Compare() {}
         virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ge_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
+            UTRACE( 8, "Predicate::Compare: destroy" );
+            Lhs::destroy( lhs, pool );
+            Rhs::destroy( rhs, pool );
             Predicate::destroy( pool );
         }
         virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->ge(b) );
+            return Op::test( Lhs::value(lhs, context), Rhs::value(rhs, context) );
         }
-    };
-    class s_ge_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_ge_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ge_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ge_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
+        virtual void depends( Dependencies& d ) {
+            Lhs::depends( lhs, d );
+            Rhs::depends( rhs, d );
         }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->ge(rhs) );
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            uint32_t k;
+            *coercion = Lhs::integer( lhs );
+            if ( *coercion == 0 || Rhs::constant(rhs, &k) == false ) return false;
+            return Op::bounds( k, lo, hi );
         }
     };
+
+    typedef Compare< EQ, IntegerRegister<>, IntegerRegister<> > i_eq_r_r;
+    typedef Compare< EQ, IntegerRegister<>, IntegerImmediate  > i_eq_r_i;
+    typedef Compare< NE, IntegerRegister<>, IntegerRegister<> > i_ne_r_r;
+    typedef Compare< NE, IntegerRegister<>, IntegerImmediate  > i_ne_r_i;
+    typedef Compare< LT, IntegerRegister<>, IntegerRegister<> > i_lt_r_r;
+    typedef Compare< LT, IntegerRegister<>, IntegerImmediate  > i_lt_r_i;
+    typedef Compare< GT, IntegerRegister<>, IntegerRegister<> > i_gt_r_r;
+    typedef Compare< GT, IntegerRegister<>, IntegerImmediate  > i_gt_r_i;
+    typedef Compare< LE, IntegerRegister<>, IntegerRegister<> > i_le_r_r;
+    typedef Compare< LE, IntegerRegister<>, IntegerImmediate  > i_le_r_i;
+    typedef Compare< GE, IntegerRegister<>, IntegerRegister<> > i_ge_r_r;
+    typedef Compare< GE, IntegerRegister<>, IntegerImmediate  > i_ge_r_i;
+
+    typedef Compare< EQ, StringRegister<>, StringRegister<> > s_eq_r_r;
+    typedef Compare< EQ, StringRegister<>, StringImmediate  > s_eq_r_i;
+    typedef Compare< NE, StringRegister<>, StringRegister<> > s_ne_r_r;
+    typedef Compare< NE, StringRegister<>, StringImmediate  > s_ne_r_i;
+    typedef Compare< LT, StringRegister<>, StringRegister<> > s_lt_r_r;
+    typedef Compare< LT, StringRegister<>, StringImmediate  > s_lt_r_i;
+    typedef Compare< GT, StringRegister<>, StringRegister<> > s_gt_r_r;
+    typedef Compare< GT, StringRegister<>, StringImmediate  > s_gt_r_i;
+    typedef Compare< LE, StringRegister<>, StringRegister<> > s_le_r_r;
+    typedef Compare< LE, StringRegister<>, StringImmediate  > s_le_r_i;
+    typedef Compare< GE, StringRegister<>, StringRegister<> > s_ge_r_r;
+    typedef Compare< GE, StringRegister<>, StringImmediate  > s_ge_r_i;
+
+    /*
+     * Devirtualized shapes for the common operands.  FieldString is
+     * defined out of line, so its call is direct but not inlined.
+     */
+    typedef Compare< EQ, IntegerRegister<FieldValue>,  IntegerImmediate > i_eq_fv_i;
+    typedef Compare< NE, IntegerRegister<FieldValue>,  IntegerImmediate > i_ne_fv_i;
+    typedef Compare< LT, IntegerRegister<FieldValue>,  IntegerImmediate > i_lt_fv_i;
+    typedef Compare< GT, IntegerRegister<FieldValue>,  IntegerImmediate > i_gt_fv_i;
+    typedef Compare< LE, IntegerRegister<FieldValue>,  IntegerImmediate > i_le_fv_i;
+    typedef Compare< GE, IntegerRegister<FieldValue>,  IntegerImmediate > i_ge_fv_i;
+    typedef Compare< EQ, IntegerRegister<FieldLength>, IntegerImmediate > i_eq_fl_i;
+    typedef Compare< NE, IntegerRegister<FieldLength>, IntegerImmediate > i_ne_fl_i;
+    typedef Compare< LT, IntegerRegister<FieldLength>, IntegerImmediate > i_lt_fl_i;
+    typedef Compare< GT, IntegerRegister<FieldLength>, IntegerImmediate > i_gt_fl_i;
+    typedef Compare< LE, IntegerRegister<FieldLength>, IntegerImmediate > i_le_fl_i;
+    typedef Compare< GE, IntegerRegister<FieldLength>, IntegerImmediate > i_ge_fl_i;
+    typedef Compare< EQ, StringRegister<FieldString>,  StringImmediate  > s_eq_fs_i;
+    typedef Compare< NE, StringRegister<FieldString>,  StringImmediate  > s_ne_fs_i;
     
     class s_prefix_r_i : public Predicate {
         StringCoercion *lhs;
@@ -801,6 +647,7 @@ namespace Service {
         virtual ~s_prefix_r_i() {}
         virtual void destroy( Pool * );
         virtual bool operator() ( Context * );
+        virtual void depends( Dependencies& d ) { lhs->depends( d ); }
     };
     class Contains : public Predicate {
         IntegerCoercion *coercion;
@@ -811,6 +658,7 @@ namespace Service {
         virtual ~Contains() {}
         virtual void destroy( Pool * );
         virtual bool operator() ( Context * );
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
     };
     class BinaryLogic : public Predicate {
     protected:
@@ -821,6 +669,10 @@ namespace Service {
         : lhs(lhs), rhs(rhs) {}
         virtual ~BinaryLogic() {}
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) {
+            lhs->depends( d );
+            rhs->depends( d );
+        }
     };
     class OR : public BinaryLogic {
     public:
@@ -842,6 +694,18 @@ namespace Service {
         : BinaryLogic(lhs, rhs) {}
         virtual void destroy(Pool *);
         virtual bool operator() ( Context * );
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            IntegerCoercion *a, *b;
+            uint64_t alo, ahi, blo, bhi;
+            if ( lhs->interval(&a, &alo, &ahi) == false ) return false;
+            if ( rhs->interval(&b, &blo, &bhi) == false ) return false;
+            if ( a && b && IntegerCoercion::equivalent(a, b) == false ) return false;
+            *coercion = a ? a : b;
+            *lo = alo > blo ? alo : blo;
+            *hi = ahi < bhi ? ahi : bhi;
+            if ( *hi < *lo ) *hi = *lo;
+            return true;
+        }
     };
     class NAND : public BinaryLogic {
     public:
@@ -857,6 +721,7 @@ namespace Service {
         virtual ~NOT() {}
         virtual bool operator() ( Context * );
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { operand->depends( d ); }
     };
     class AddressMatches : public Predicate {
         uint32_t matchAddress;
@@ -869,6 +734,7 @@ namespace Service {
         virtual ~AddressMatches() {}
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     class LocationMatchAllPorts : public Predicate {
         Field *field;
@@ -877,6 +743,7 @@ namespace Service {
         virtual ~LocationMatchAllPorts() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.add( field ); }
     };
     class LocationMatchOnePortNeeded : public Predicate {
         Field *field;
@@ -885,6 +752,7 @@ namespace Service {
         virtual ~LocationMatchOnePortNeeded() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.add( field ); }
     };
     class ConnectionDelete : public Predicate {
     public:
@@ -892,6 +760,7 @@ namespace Service {
         virtual ~ConnectionDelete() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     class ConnectionInsert : public Predicate {
     public:
@@ -899,6 +768,7 @@ namespace Service {
         virtual ~ConnectionInsert() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     class SetCookieInsert : public Predicate {
     public:
@@ -906,6 +776,7 @@ namespace Service {
         virtual ~SetCookieInsert() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     class IsPassive : public Predicate {
     public:
@@ -913,6 +784,7 @@ namespace Service {
         virtual ~IsPassive() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     class SSLCipherInsert : public Predicate {
     public:
@@ -920,6 +792,7 @@ namespace Service {
         virtual ~SSLCipherInsert() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     
     bool Initialize( Tcl_Interp *, OPE * );
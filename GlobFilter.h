@@ -0,0 +1,218 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_GLOBFILTER_H_
+#define _OBJECT_GLOBFILTER_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include "tcl.h"
+#include "Scan.h"
+
+/*
+ * Literal anchors for Glob patterns.
+ *
+ * Most subjects tested against a pattern like "*.example.com" do not
+ * match, and almost all of them can be rejected without walking the
+ * automaton: the subject must end with ".example.com", must be at least
+ * that long, and so on.  GlobFilter extracts from a pattern
+ *
+ *   - the literal prefix before the first wildcard,
+ *   - the literal suffix after the last wildcard,
+ *   - the longest literal run between wildcards,
+ *   - the minimum subject length,
+ *
+ * and admits() checks them, with memcmp and Scan::search, before the
+ * Glob is run.  Anchors longer than ANCHOR are truncated, which keeps
+ * them necessary conditions.  After a '[' or '\\' only the prefix is
+ * used, since bracket expressions and escapes are not literal.
+ *
+ * GlobMatches is Matches with the filter in front and an optional
+ * caseless mode: the pattern and anchors are folded to lower case when
+ * the predicate is built, the anchors are compared caselessly in place,
+ * and only a subject that passes the filter is folded for the automaton.
+ */
+
+namespace Service {
+
+    class GlobFilter {
+    public:
+        static const uint32_t ANCHOR = 32;
+    private:
+        char prefix[ANCHOR];
+        char suffix[ANCHOR];
+        char inner[ANCHOR];
+        uint8_t prefixLength;
+        uint8_t suffixLength;
+        uint8_t innerLength;
+        bool exact;             // no '*': the length is fixed
+        bool caseless;
+        uint32_t minimum;
+
+        static bool wild( char c ) { return c == '*' || c == '?'; }
+        static bool special( char c ) { return c == '[' || c == '\\'; }
+
+        static void keep( char *to, uint8_t *length, const char *from, uint32_t n, bool tail ) {
+            if ( n > ANCHOR ) {
+                if ( tail ) from += n - ANCHOR;
+                n = ANCHOR;
+            }
+            memcpy( to, from, n );
+            *length = n;
+        }
+    public:
+        GlobFilter( const char *pattern, bool caseless )
+        : prefixLength(0), suffixLength(0), innerLength(0),
+          exact(true), caseless(caseless), minimum(0) {
+            uint32_t n = strlen( pattern );
+            uint32_t i = 0;
+            while ( i < n && wild(pattern[i]) == false && special(pattern[i]) == false ) i++;
+            keep( prefix, &prefixLength, pattern, i, false );
+            for ( uint32_t j = 0 ; j < n ; j++ ) {
+                if ( special(pattern[j]) ) {
+                    // only the prefix is trustworthy
+                    exact = false;
+                    minimum = prefixLength;
+                    fold();
+                    return;
+                }
+            }
+            if ( i == n ) {             // no wildcards at all
+                minimum = n;
+                fold();
+                return;
+            }
+            uint32_t start = i;
+            for ( uint32_t j = 0 ; j < n ; j++ ) {
+                if ( pattern[j] == '*' ) exact = false;
+                else minimum++;
+            }
+            uint32_t end = n;
+            while ( end > 0 && wild(pattern[end - 1]) == false ) end--;
+            keep( suffix, &suffixLength, pattern + end, n - end, true );
+            for ( uint32_t j = start ; j < end ; ) {
+                while ( j < end && wild(pattern[j]) ) j++;
+                uint32_t k = j;
+                while ( k < end && wild(pattern[k]) == false ) k++;
+                if ( k - j > innerLength ) keep( inner, &innerLength, pattern + j, k - j, false );
+                j = k;
+            }
+            fold();
+        }
+
+        void fold() {
+            if ( caseless == false ) return;
+            for ( uint32_t i = 0 ; i < prefixLength ; i++ ) prefix[i] = Scan::fold( prefix[i] );
+            for ( uint32_t i = 0 ; i < suffixLength ; i++ ) suffix[i] = Scan::fold( suffix[i] );
+            for ( uint32_t i = 0 ; i < innerLength ; i++ ) inner[i] = Scan::fold( inner[i] );
+        }
+
+        bool admits( const char *s, uint32_t length ) const {
+            if ( length < minimum ) return false;
+            if ( exact && length != minimum ) return false;
+            if ( Scan::same(s, prefix, prefixLength, caseless) == false ) return false;
+            if ( suffixLength ) {
+                if ( length < prefixLength + suffixLength ) return false;
+                const char *tail = s + length - suffixLength;
+                if ( Scan::same(tail, suffix, suffixLength, caseless) == false ) return false;
+            }
+            if ( innerLength ) {
+                const char *from = s + prefixLength;
+                const char *to = s + length - suffixLength;
+                if ( Scan::search(from, to, inner, innerLength, caseless) == 0 ) return false;
+            }
+            return true;
+        }
+    };
+
+    class GlobMatches : public Predicate {
+        StringCoercion *coercion;
+        Glob *glob;
+        GlobFilter filter;
+        bool caseless;
+        bool owned;             // glob is destroyed with the predicate
+
+    public:
+        /*
+         * If the folded copy cannot be allocated the pattern is compiled
+         * as given, and upper case letters in it will not match.
+         */
+        static Glob *compile( Pool *pool, const char *pattern, bool caseless ) {
+            if ( caseless == false ) return new (pool) Glob( pool, pattern );
+            uint32_t n = strlen( pattern );
+            char *folded = (char *)malloc( n + 1 );
+            if ( folded == 0 ) {
+                UTRACE( 1, "Predicate::GlobMatches: cannot fold pattern" );
+                return new (pool) Glob( pool, pattern );
+            }
+            for ( uint32_t i = 0 ; i <= n ; i++ ) folded[i] = Scan::fold( pattern[i] );
+            Glob *result = new (pool) Glob( pool, folded );
+            free( folded );
+            return result;
+        }
+    protected:
+        /*
+         * Borrow a Glob compiled elsewhere (see TclTypes.h); filter and
+         * flags must describe the same pattern.
+         */
+        GlobMatches( StringCoercion *coercion, Glob *glob, const GlobFilter& filter, bool caseless )
+        : coercion(coercion), glob(glob), filter(filter),
+          caseless(caseless), owned(false) { }
+    public:
+        enum { CASELESS = 1 };
+
+        GlobMatches( Pool *pool, StringCoercion *coercion, const char *pattern, uint32_t flags = 0 )
+        : coercion(coercion),
+          glob( compile(pool, pattern, (flags & CASELESS) != 0) ),
+          filter( pattern, (flags & CASELESS) != 0 ),
+          caseless( (flags & CASELESS) != 0 ), owned(true) { }
+        virtual ~GlobMatches() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "Predicate::GlobMatches: destroy" );
+            coercion->destroy( pool );
+            if ( owned ) glob->destroy( pool );
+            Predicate::destroy( pool );
+        }
+        virtual bool operator() ( Context *context ) {
+            String *s = (*coercion)( context );
+            if ( s->start == 0 ) return false;
+            if ( filter.admits(s->start, s->length) == false ) return false;
+            if ( caseless == false ) return glob->match( s->start, s->length );
+            char local[256];
+            char *folded = ( s->length <= sizeof(local) ) ? local : (char *)malloc( s->length );
+            if ( folded == 0 ) {
+                UTRACE( 1, "Predicate::GlobMatches: cannot fold subject" );
+                return glob->match( s->start, s->length );
+            }
+            for ( uint32_t i = 0 ; i < s->length ; i++ ) folded[i] = Scan::fold( s->start[i] );
+            bool result = glob->match( folded, s->length );
+            if ( folded != local ) free( folded );
+            return result;
+        }
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,192 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_INTERVAL_H_
+#define _OBJECT_INTERVAL_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include "tcl.h"
+
+/*
+ * Cond chains over integer ranges.
+ *
+ * Rate tiers, Content-Length buckets and port ranges are written as
+ *
+ *     cond { AND(i_ge_r_i(x, 0), i_lt_r_i(x, 1024)) { ... }
+ *            AND(i_ge_r_i(x, 1024), i_lt_r_i(x, 65536)) { ... }
+ *            T { ... } }
+ *
+ * which costs two virtual compares per selection.  When every
+ * selection's predicate describes an interval of the same coercion
+ * (Predicate::interval()), IntervalCond::build() cuts the value range
+ * at every bound, gives each piece the block of the first selection
+ * that covers it -- the one Cond would pick -- and merges neighbours
+ * with the same block.  Selection is then one coercion call and a
+ * branchless binary search over the piece boundaries.
+ *
+ * IntervalCond::select() is the drop-in for "new (pool) Cond(...)" when
+ * a cond is compiled: it returns the IntervalCond when one applies and
+ * a plain Cond otherwise.
+ */
+
+namespace Service {
+
+    class IntervalCond : public Verb {
+        Selection *selection;
+        IntegerCoercion *coercion;
+        uint32_t *edge;             // edge[i] is the first value of piece i
+        Verb **block;               // 0 where no selection matches
+        uint32_t pieces;
+
+        IntervalCond( Selection *selection, IntegerCoercion *coercion, Verb *next )
+        : Verb(next), selection(selection), coercion(coercion),
+          edge(0), block(0), pieces(0) { }
+
+        static int ascending( const void *a, const void *b ) {
+            uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+            return x < y ? -1 : x > y;
+        }
+    public:
+        /*
+         * An IntervalCond equivalent to Cond(selection, next), or 0 if
+         * the selections are not all intervals of one coercion.
+         */
+        static IntervalCond *build( Pool *pool, Selection *selection, Verb *next ) {
+            uint32_t count = 0;
+            IntegerCoercion *common = 0;
+            for ( Selection *s = selection ; s ; s = s->next ) {
+                IntegerCoercion *c;
+                uint64_t lo, hi;
+                if ( s->predicate->interval(&c, &lo, &hi) == false ) return 0;
+                if ( c && common && IntegerCoercion::equivalent(c, common) == false ) return 0;
+                if ( c && common == 0 ) common = c;
+                count++;
+            }
+            if ( common == 0 || count < 2 ) return 0;
+
+            uint64_t *lo = (uint64_t *)malloc( count * sizeof(uint64_t) );
+            uint64_t *hi = (uint64_t *)malloc( count * sizeof(uint64_t) );
+            uint64_t *cut = (uint64_t *)malloc( (2 * count + 1) * sizeof(uint64_t) );
+            Verb **blocks = (Verb **)malloc( count * sizeof(Verb *) );
+            uint32_t *edges = (uint32_t *)malloc( (2 * count + 1) * sizeof(uint32_t) );
+            Verb **chosen = (Verb **)malloc( (2 * count + 1) * sizeof(Verb *) );
+            if ( lo == 0 || hi == 0 || cut == 0 || blocks == 0 || edges == 0 || chosen == 0 ) {
+                UTRACE( 1, "IntervalCond: out of memory, using Cond" );
+                free( lo );
+                free( hi );
+                free( cut );
+                free( blocks );
+                free( edges );
+                free( chosen );
+                return 0;
+            }
+            uint32_t cuts = 0;
+            cut[cuts++] = 0;
+            uint32_t i = 0;
+            for ( Selection *s = selection ; s ; s = s->next, i++ ) {
+                IntegerCoercion *c;
+                s->predicate->interval( &c, &lo[i], &hi[i] );
+                blocks[i] = s->block;
+                if ( lo[i] < (1ULL << 32) ) cut[cuts++] = lo[i];
+                if ( hi[i] < (1ULL << 32) ) cut[cuts++] = hi[i];
+            }
+            qsort( cut, cuts, sizeof(uint64_t), ascending );
+
+            IntervalCond *result = new (pool) IntervalCond( selection, common, next );
+            result->edge = edges;
+            result->block = chosen;
+            for ( uint32_t k = 0 ; k < cuts ; k++ ) {
+                if ( k > 0 && cut[k] == cut[k - 1] ) continue;
+                Verb *first = 0;
+                for ( uint32_t j = 0 ; j < count ; j++ ) {
+                    if ( lo[j] <= cut[k] && cut[k] < hi[j] ) {
+                        first = blocks[j];
+                        break;
+                    }
+                }
+                uint32_t n = result->pieces;
+                if ( n > 0 && chosen[n - 1] == first ) continue;
+                edges[n] = (uint32_t)cut[k];
+                chosen[n] = first;
+                result->pieces++;
+            }
+            free( lo );
+            free( hi );
+            free( cut );
+            free( blocks );
+            UTRACE2( 3, "IntervalCond: selections, pieces", count, result->pieces );
+            return result;
+        }
+
+        /*
+         * The Verb for a compiled cond: an IntervalCond if the chain
+         * qualifies, otherwise a Cond.
+         */
+        static Verb *select( Pool *pool, Selection *selection, Verb *next ) {
+            IntervalCond *fast = build( pool, selection, next );
+            if ( fast ) return fast;
+            return new (pool) Cond( selection, next );
+        }
+
+        virtual ~IntervalCond() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "Verb::IntervalCond: destroy" );
+            if ( selection ) selection->destroy( pool );
+            free( edge );
+            free( block );
+            Verb::destroy( pool );
+        }
+
+        /*
+         * Index of the piece holding value: the last edge <= value.
+         * edge[0] is always 0.
+         */
+        uint32_t piece( uint32_t value ) const {
+            const uint32_t *base = edge;
+            uint32_t n = pieces;
+            while ( n > 1 ) {
+                uint32_t half = n / 2;
+                base = ( base[half] <= value ) ? base + half : base;
+                n -= half;
+            }
+            return base - edge;
+        }
+
+        virtual void operator() ( Context& context ) {
+            Verb *chosen = block[ piece( (*coercion)(&context) ) ];
+            if ( chosen ) (*chosen)( context );
+            if ( next ) (*next)( context );
+        }
+        virtual void depends( Dependencies& d ) {
+            coercion->depends( d );
+            for ( Selection *s = selection ; s ; s = s->next ) {
+                s->block->depends( d );
+            }
+            if ( next ) next->depends( d );
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,159 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_NUMERIC_H_
+#define _OBJECT_NUMERIC_H_
+
+#include <stdint.h>
+#include <cstring>
+
+/*
+ * Overflow safe integer parsing for header values.
+ *
+ * decimal() consumes eight digits per step with SWAR arithmetic on a
+ * single 64 bit word and falls back to a byte loop for the tail.  It is
+ * used for Content-Length and Range offsets.  hexadecimal() is used for
+ * chunk sizes, which are rarely more than a few digits long, and goes
+ * through a lookup table.  All of them return the number of bytes
+ * consumed and zero on an empty number or on 64 bit overflow.
+ */
+
+namespace Service {
+    namespace Numeric {
+
+        inline uint64_t load8( const char *s ) {
+            uint64_t x;
+            memcpy( &x, s, sizeof(x) );
+        #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            x = __builtin_bswap64( x );
+        #endif
+            return x;
+        }
+
+        /*
+         * True if all eight bytes are '0'..'9'.
+         */
+        inline bool digits8( uint64_t x ) {
+            return ( ( (x & 0xF0F0F0F0F0F0F0F0ULL) |
+                       (((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4) )
+                     == 0x3333333333333333ULL );
+        }
+
+        /*
+         * Value of eight ASCII digits, first digit in the low byte.
+         */
+        inline uint32_t value8( uint64_t x ) {
+            const uint64_t mask = 0x000000FF000000FFULL;
+            const uint64_t mul1 = 100 + (1000000ULL << 32);
+            const uint64_t mul2 = 1 + (10000ULL << 32);
+            x -= 0x3030303030303030ULL;
+            x = (x * 10) + (x >> 8);
+            x = ( ((x & mask) * mul1) + (((x >> 16) & mask) * mul2) ) >> 32;
+            return (uint32_t)x;
+        }
+
+        inline uint32_t decimal( const char *s, uint32_t length, uint64_t *result ) {
+            uint64_t value = 0;
+            uint32_t i = 0;
+            while ( length - i >= 8 ) {
+                uint64_t x = load8( s + i );
+                if ( digits8(x) == false ) break;
+                uint64_t chunk = value8( x );
+                if ( value > (UINT64_MAX - chunk) / 100000000ULL ) return 0;
+                value = value * 100000000ULL + chunk;
+                i += 8;
+            }
+            for ( ; i < length ; i++ ) {
+                uint32_t d = (uint8_t)s[i] - '0';
+                if ( d > 9 ) break;
+                if ( value > (UINT64_MAX - d) / 10 ) return 0;
+                value = value * 10 + d;
+            }
+            if ( i == 0 ) return 0;
+            *result = value;
+            return i;
+        }
+
+        inline uint32_t hexadecimal( const char *s, uint32_t length, uint64_t *result ) {
+            static const int8_t nybble[256] = {
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+                -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+                -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+            };
+            uint64_t value = 0;
+            uint32_t i = 0;
+            for ( ; i < length ; i++ ) {
+                int8_t d = nybble[(uint8_t)s[i]];
+                if ( d < 0 ) break;
+                if ( value >> 60 ) return 0;
+                value = (value << 4) | d;
+            }
+            if ( i == 0 ) return 0;
+            *result = value;
+            return i;
+        }
+
+        /*
+         * A single "bytes=first-last" range.  A missing first is a
+         * suffix range and a missing last runs to the end; both are
+         * reported as UINT64_MAX.
+         */
+        inline bool range( const char *s, uint32_t length, uint64_t *first, uint64_t *last ) {
+            if ( length < 7 || strncmp(s, "bytes=", 6) != 0 ) return false;
+            s += 6; length -= 6;
+            uint32_t n = decimal( s, length, first );
+            if ( n == 0 ) *first = UINT64_MAX;
+            s += n; length -= n;
+            if ( length == 0 || *s != '-' ) return false;
+            s++; length--;
+            n = decimal( s, length, last );
+            if ( n == 0 ) *last = UINT64_MAX;
+            if ( n != length ) return false;
+            return ( *first != UINT64_MAX || *last != UINT64_MAX );
+        }
+
+        /*
+         * Field::value is 32 bits wide; larger numbers saturate so that
+         * threshold predicates still order them correctly.
+         */
+        inline uint32_t saturate( uint64_t value ) {
+            return ( value > 0xffffffffULL ) ? 0xffffffff : (uint32_t)value;
+        }
+    }
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
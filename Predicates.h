@@ -28,9 +28,12 @@
 #include <cstdlib>
 #include "tcl.h"
 #include "crc32.h"
+#include "Trace.h"
+#include "Dependencies.h"
 
 namespace Service {
 
+    class IntegerCoercion;
     class Predicate {
     public:
         virtual ~Predicate() {}
@@ -38,6 +41,16 @@ namespace Service {
         void * operator new ( std::size_t, Pool * );
         void operator delete ( void * ) {}
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { d.unknown(); }
+
+        /*
+         * True if this predicate holds exactly when coercion's value is
+         * in [lo, hi); coercion 0 means any coercion.  Used to turn Cond
+         * chains of range tests into an IntervalCond.
+         */
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            return false;
+        }
     };
 
     class AnnotatedPredicate {
@@ -57,6 +70,13 @@ namespace Service {
         virtual void destroy(Pool *pool) {}
         virtual bool
         operator () ( Context *context ) { return true; }
+        virtual void depends( Dependencies& d ) { }
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            *coercion = 0;
+            *lo = 0;
+            *hi = 1ULL << 32;
+            return true;
+        }
     };
 
     class F : public Predicate {
@@ -66,6 +86,7 @@ namespace Service {
         virtual void destroy(Pool *pool) {}
         virtual bool
         operator () ( Context *context ) { return false; }
+        virtual void depends( Dependencies& d ) { }
     };
 
     class Matches : public Predicate {
@@ -77,6 +98,7 @@ namespace Service {
         virtual ~Matches() {}
         virtual bool operator() ( Context * );
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { ff->depends( d ); }
     };
 
     class present : public Predicate {
@@ -86,6 +108,7 @@ namespace Service {
         virtual ~present() { }
         virtual bool operator() ( Context * ) ;
         virtual void destroy( Pool * );
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
     };
 
     class absent : public Predicate {
@@ -95,451 +118,224 @@ namespace Service {
         virtual ~absent() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context * );
-    };
-
-    class i_eq_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_eq_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_eq_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_eq_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) == (*rhs)(context) );
-        }
-    };
-
-    class i_eq_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_eq_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_eq_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_eq_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) == rhs );
-        }
-    };
-    
-    class i_ne_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_ne_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ne_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_ne_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) != (*rhs)(context) );
-        }
-    };
-
-    class i_ne_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_ne_r_i( IntegerCoercion *lhs, uint32_t rhs )
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
+    };
+
+    /*
+     * The comparison predicates.
+     *
+     * Compare<Op, Lhs, Rhs> is the whole family: Op is the relation, Lhs
+     * and Rhs say where each operand comes from -- a coercion register or
+     * an immediate -- and, for registers, the coercion's concrete type.
+     * When the concrete type is known the coercion is called with a
+     * qualified, non-virtual call, so FieldValue or FieldLength against
+     * an immediate compiles to a load and a compare with no virtual call
+     * inside the predicate.  The base coercion types fall back to the
+     * usual virtual call.  The historical i_*_r_* and s_*_r_* names are
+     * typedefs of the generic instantiations.
+     */
+    #if __cplusplus >= 201103L
+    #define COMPARE_FINAL final
+    #else
+    #define COMPARE_FINAL
+    #endif
+
+    template <class C = IntegerCoercion>
+    struct IntegerRegister {
+        typedef C *type;
+        static uint32_t value( C *c, Context *context ) {
+            return c->C::operator()( context );
+        }
+        static void destroy( C *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( C *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( C *c ) { return c; }
+        static bool constant( C *, uint32_t * ) { return false; }
+    };
+    template <>
+    struct IntegerRegister<IntegerCoercion> {
+        typedef IntegerCoercion *type;
+        static uint32_t value( IntegerCoercion *c, Context *context ) {
+            return (*c)( context );
+        }
+        static void destroy( IntegerCoercion *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( IntegerCoercion *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( IntegerCoercion *c ) { return c; }
+        static bool constant( IntegerCoercion *, uint32_t * ) { return false; }
+    };
+    struct IntegerImmediate {
+        typedef uint32_t type;
+        static uint32_t value( uint32_t v, Context * ) { return v; }
+        static void destroy( uint32_t, Pool * ) { }
+        static void depends( uint32_t, Dependencies& ) { }
+        static IntegerCoercion *integer( uint32_t ) { return 0; }
+        static bool constant( uint32_t v, uint32_t *k ) { *k = v; return true; }
+    };
+
+    template <class C = StringCoercion>
+    struct StringRegister {
+        typedef C *type;
+        static String *value( C *c, Context *context ) {
+            return c->C::operator()( context );
+        }
+        static void destroy( C *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( C *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( C * ) { return 0; }
+        static bool constant( C *, uint32_t * ) { return false; }
+    };
+    template <>
+    struct StringRegister<StringCoercion> {
+        typedef StringCoercion *type;
+        static String *value( StringCoercion *c, Context *context ) {
+            return (*c)( context );
+        }
+        static void destroy( StringCoercion *c, Pool *pool ) {
+            if ( c ) c->destroy( pool );
+        }
+        static void depends( StringCoercion *c, Dependencies& d ) { c->depends( d ); }
+        static IntegerCoercion *integer( StringCoercion * ) { return 0; }
+        static bool constant( StringCoercion *, uint32_t * ) { return false; }
+    };
+    struct StringImmediate {
+        typedef String *type;
+        static String *value( String *v, Context * ) { return v; }
+        static void destroy( String *v, Pool *pool ) {
+            if ( v ) v->destroy( pool );
+        }
+        static void depends( String *, Dependencies& ) { }
+        static IntegerCoercion *integer( String * ) { return 0; }
+        static bool constant( String *, uint32_t * ) { return false; }
+    };
+
+    struct EQ {
+        static bool test( uint32_t a, uint32_t b ) { return a == b; }
+        static bool test( String *a, String *b ) { return a->eq(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = k;
+            *hi = k + 1;
+            return true;
+        }
+    };
+    struct NE {
+        static bool test( uint32_t a, uint32_t b ) { return a != b; }
+        static bool test( String *a, String *b ) { return a->ne(b); }
+        static bool bounds( uint64_t, uint64_t *, uint64_t * ) { return false; }
+    };
+    struct LT {
+        static bool test( uint32_t a, uint32_t b ) { return a < b; }
+        static bool test( String *a, String *b ) { return a->lt(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = 0;
+            *hi = k;
+            return true;
+        }
+    };
+    struct GT {
+        static bool test( uint32_t a, uint32_t b ) { return a > b; }
+        static bool test( String *a, String *b ) { return a->gt(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = k + 1;
+            *hi = 1ULL << 32;
+            return true;
+        }
+    };
+    struct LE {
+        static bool test( uint32_t a, uint32_t b ) { return a <= b; }
+        static bool test( String *a, String *b ) { return a->le(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = 0;
+            *hi = k + 1;
+            return true;
+        }
+    };
+    struct GE {
+        static bool test( uint32_t a, uint32_t b ) { return a >= b; }
+        static bool test( String *a, String *b ) { return a->ge(b); }
+        static bool bounds( uint64_t k, uint64_t *lo, uint64_t *hi ) {
+            *lo = k;
+            *hi = 1ULL << 32;
+            return true;
+        }
+    };
+
+    template <class Op, class Lhs, class Rhs>
+    class Compare COMPARE_FINAL : public Predicate {
+        typename Lhs::type lhs;
+        typename Rhs::type rhs;
+    public:
+        Compare( typename Lhs::type lhs, typename Rhs::type rhs )
         : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ne_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_ne_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) != rhs );
-        }
-    };
-    
-    class i_lt_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_lt_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_lt_r_r() {}
+        virtual ~Compare() {}
         virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_lt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
+            UTRACE( 8, "Predicate::Compare: destroy" );
+            Lhs::destroy( lhs, pool );
+            Rhs::destroy( rhs, pool );
             Predicate::destroy( pool );
         }
         virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) < (*rhs)(context) );
-        }
-    };
-
-    class i_lt_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_lt_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_lt_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_lt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) < rhs );
-        }
-    };
-    
-    class i_gt_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_gt_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_gt_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_gt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) > (*rhs)(context) );
-        }
-    };
-
-    class i_gt_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_gt_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_gt_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_gt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) > rhs );
-        }
-    };
-    
-    class i_le_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_le_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_le_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_le_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) <= (*rhs)(context) );
-        }
-    };
-
-    class i_le_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_le_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_le_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_le_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) <= rhs );
-        }
-    };
-    
-    class i_ge_r_r : public Predicate {
-        IntegerCoercion *lhs;
-        IntegerCoercion *rhs;
-    public:
-        i_ge_r_r( IntegerCoercion *lhs, IntegerCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ge_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::i_ge_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) >= (*rhs)(context) );
-        }
-    };
-
-    class i_ge_r_i : public Predicate {
-        IntegerCoercion *lhs;
-        uint32_t rhs;
-    public:
-        i_ge_r_i( IntegerCoercion *lhs, uint32_t rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~i_ge_r_i() { }
-        virtual void destroy(Pool *pool) {
-            UINFO( 8, "Predicate::i_ge_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            return ( (*lhs)(context) >= rhs );
-        }
-    };
-    
-    class s_eq_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_eq_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_eq_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_eq_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->eq(b) );
-        }
-    };
-
-    class s_eq_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_eq_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_eq_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_eq_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->eq(rhs) );
-        }
-    };
-    
-    class s_ne_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_ne_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ne_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ne_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->ne(b) );
-        }
-    };
-
-    class s_ne_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_ne_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ne_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ne_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->ne(rhs) );
-        }
-    };
-    
-    class s_lt_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_lt_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_lt_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_lt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->lt(b) );
-        }
-    };
-
-    class s_lt_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_lt_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_lt_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_lt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->lt(rhs) );
-        }
-    };
-    
-    class s_gt_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_gt_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_gt_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_gt_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->gt(b) );
-        }
-    };
-
-    class s_gt_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_gt_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_gt_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_gt_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->gt(rhs) );
-        }
-    };
-    
-    class s_le_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_le_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_le_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_le_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->le(b) );
-        }
-    };
-
-    class s_le_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_le_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_le_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_le_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->le(rhs) );
-        }
-    };
-    
-    class s_ge_r_r : public Predicate {
-        StringCoercion *lhs;
-        StringCoercion *rhs;
-    public:
-        s_ge_r_r( StringCoercion *lhs, StringCoercion *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ge_r_r() {}
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ge_r_r: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            String *b = (*rhs)(context);
-            return ( a->ge(b) );
-        }
-    };
-
-    class s_ge_r_i : public Predicate {
-        StringCoercion *lhs;
-        String *rhs;
-    public:
-        s_ge_r_i( StringCoercion *lhs, String *rhs )
-        : lhs(lhs), rhs(rhs)  {}
-        virtual ~s_ge_r_i() { }
-        virtual void destroy( Pool *pool ) {
-            UINFO( 8, "Predicate::s_ge_r_i: destroy" << endl );
-            if ( lhs ) lhs->destroy( pool );
-            if ( rhs ) rhs->destroy( pool );
-            Predicate::destroy( pool );
-        }
-        virtual bool operator() ( Context *context ) {
-            String *a = (*lhs)(context);
-            return ( a->ge(rhs) );
-        }
-    };
+            return Op::test( Lhs::value(lhs, context), Rhs::value(rhs, context) );
+        }
+        virtual void depends( Dependencies& d ) {
+            Lhs::depends( lhs, d );
+            Rhs::depends( rhs, d );
+        }
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            uint32_t k;
+            *coercion = Lhs::integer( lhs );
+            if ( *coercion == 0 || Rhs::constant(rhs, &k) == false ) return false;
+            return Op::bounds( k, lo, hi );
+        }
+    };
+
+    typedef Compare< EQ, IntegerRegister<>, IntegerRegister<> > i_eq_r_r;
+    typedef Compare< EQ, IntegerRegister<>, IntegerImmediate  > i_eq_r_i;
+    typedef Compare< NE, IntegerRegister<>, IntegerRegister<> > i_ne_r_r;
+    typedef Compare< NE, IntegerRegister<>, IntegerImmediate  > i_ne_r_i;
+    typedef Compare< LT, IntegerRegister<>, IntegerRegister<> > i_lt_r_r;
+    typedef Compare< LT, IntegerRegister<>, IntegerImmediate  > i_lt_r_i;
+    typedef Compare< GT, IntegerRegister<>, IntegerRegister<> > i_gt_r_r;
+    typedef Compare< GT, IntegerRegister<>, IntegerImmediate  > i_gt_r_i;
+    typedef Compare< LE, IntegerRegister<>, IntegerRegister<> > i_le_r_r;
+    typedef Compare< LE, IntegerRegister<>, IntegerImmediate  > i_le_r_i;
+    typedef Compare< GE, IntegerRegister<>, IntegerRegister<> > i_ge_r_r;
+    typedef Compare< GE, IntegerRegister<>, IntegerImmediate  > i_ge_r_i;
+
+    typedef Compare< EQ, StringRegister<>, StringRegister<> > s_eq_r_r;
+    typedef Compare< EQ, StringRegister<>, StringImmediate  > s_eq_r_i;
+    typedef Compare< NE, StringRegister<>, StringRegister<> > s_ne_r_r;
+    typedef Compare< NE, StringRegister<>, StringImmediate  > s_ne_r_i;
+    typedef Compare< LT, StringRegister<>, StringRegister<> > s_lt_r_r;
+    typedef Compare< LT, StringRegister<>, StringImmediate  > s_lt_r_i;
+    typedef Compare< GT, StringRegister<>, StringRegister<> > s_gt_r_r;
+    typedef Compare< GT, StringRegister<>, StringImmediate  > s_gt_r_i;
+    typedef Compare< LE, StringRegister<>, StringRegister<> > s_le_r_r;
+    typedef Compare< LE, StringRegister<>, StringImmediate  > s_le_r_i;
+    typedef Compare< GE, StringRegister<>, StringRegister<> > s_ge_r_r;
+    typedef Compare< GE, StringRegister<>, StringImmediate  > s_ge_r_i;
+
+    /*
+     * Devirtualized shapes for the common operands.  FieldString is
+     * defined out of line, so its call is direct but not inlined.
+     */
+    typedef Compare< EQ, IntegerRegister<FieldValue>,  IntegerImmediate > i_eq_fv_i;
+    typedef Compare< NE, IntegerRegister<FieldValue>,  IntegerImmediate > i_ne_fv_i;
+    typedef Compare< LT, IntegerRegister<FieldValue>,  IntegerImmediate > i_lt_fv_i;
+    typedef Compare< GT, IntegerRegister<FieldValue>,  IntegerImmediate > i_gt_fv_i;
+    typedef Compare< LE, IntegerRegister<FieldValue>,  IntegerImmediate > i_le_fv_i;
+    typedef Compare< GE, IntegerRegister<FieldValue>,  IntegerImmediate > i_ge_fv_i;
+    typedef Compare< EQ, IntegerRegister<FieldLength>, IntegerImmediate > i_eq_fl_i;
+    typedef Compare< NE, IntegerRegister<FieldLength>, IntegerImmediate > i_ne_fl_i;
+    typedef Compare< LT, IntegerRegister<FieldLength>, IntegerImmediate > i_lt_fl_i;
+    typedef Compare< GT, IntegerRegister<FieldLength>, IntegerImmediate > i_gt_fl_i;
+    typedef Compare< LE, IntegerRegister<FieldLength>, IntegerImmediate > i_le_fl_i;
+    typedef Compare< GE, IntegerRegister<FieldLength>, IntegerImmediate > i_ge_fl_i;
+    typedef Compare< EQ, StringRegister<FieldString>,  StringImmediate  > s_eq_fs_i;
+    typedef Compare< NE, StringRegister<FieldString>,  StringImmediate  > s_ne_fs_i;
     
     class s_prefix_r_i : public Predicate {
         StringCoercion *lhs;
@@ -550,6 +346,7 @@ namespace Service {
         virtual ~s_prefix_r_i() {}
         virtual void destroy( Pool * );
         virtual bool operator() ( Context * );
+        virtual void depends( Dependencies& d ) { lhs->depends( d ); }
     };
 
     class Contains : public Predicate {
@@ -561,6 +358,7 @@ namespace Service {
         virtual ~Contains() {}
         virtual void destroy( Pool * );
         virtual bool operator() ( Context * );
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
     };
 
     class BinaryLogic : public Predicate {
@@ -572,6 +370,10 @@ namespace Service {
         : lhs(lhs), rhs(rhs) {}
         virtual ~BinaryLogic() {}
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) {
+            lhs->depends( d );
+            rhs->depends( d );
+        }
     };
 
     class OR : public BinaryLogic {
@@ -596,6 +398,18 @@ namespace Service {
         : BinaryLogic(lhs, rhs) {}
         virtual void destroy(Pool *);
         virtual bool operator() ( Context * );
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            IntegerCoercion *a, *b;
+            uint64_t alo, ahi, blo, bhi;
+            if ( lhs->interval(&a, &alo, &ahi) == false ) return false;
+            if ( rhs->interval(&b, &blo, &bhi) == false ) return false;
+            if ( a && b && IntegerCoercion::equivalent(a, b) == false ) return false;
+            *coercion = a ? a : b;
+            *lo = alo > blo ? alo : blo;
+            *hi = ahi < bhi ? ahi : bhi;
+            if ( *hi < *lo ) *hi = *lo;
+            return true;
+        }
     };
 
     class NAND : public BinaryLogic {
@@ -613,6 +427,7 @@ namespace Service {
         virtual ~NOT() {}
         virtual bool operator() ( Context * );
         virtual void destroy(Pool *);
+        virtual void depends( Dependencies& d ) { operand->depends( d ); }
     };
 
     class AddressMatches : public Predicate {
@@ -626,6 +441,7 @@ namespace Service {
         virtual ~AddressMatches() {}
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
 
     class LocationMatchAllPorts : public Predicate {
@@ -635,6 +451,7 @@ namespace Service {
         virtual ~LocationMatchAllPorts() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.add( field ); }
     };
 
     class LocationMatchOnePortNeeded : public Predicate {
@@ -644,6 +461,7 @@ namespace Service {
         virtual ~LocationMatchOnePortNeeded() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.add( field ); }
     };
 
     class ConnectionDelete : public Predicate {
@@ -652,6 +470,7 @@ namespace Service {
         virtual ~ConnectionDelete() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
 
     class ConnectionInsert : public Predicate {
@@ -660,6 +479,7 @@ namespace Service {
         virtual ~ConnectionInsert() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
 
     class SetCookieInsert : public Predicate {
@@ -668,6 +488,7 @@ namespace Service {
         virtual ~SetCookieInsert() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
 
     class IsPassive : public Predicate {
@@ -676,6 +497,7 @@ namespace Service {
         virtual ~IsPassive() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
 
     class SSLCipherInsert : public Predicate {
@@ -684,6 +506,7 @@ namespace Service {
         virtual ~SSLCipherInsert() { }
         virtual void destroy(Pool *);
         virtual bool operator() ( Context *context );
+        virtual void depends( Dependencies& d ) { d.uncacheable(); }
     };
     
     bool Initialize( Tcl_Interp *, OPE * );
@@ -0,0 +1,288 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_PROFILE_H_
+#define _OBJECT_PROFILE_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "tcl.h"
+#include "Trace.h"
+
+/*
+ * Per rule execution profile.
+ *
+ * When the profiler is armed before a policy is loaded, Initialize()
+ * wraps each Predicate, Coercion and Verb it builds in a Profiled*
+ * node registered as a Site, carrying the kind of node and the source
+ * text of the rule it came from.  A policy loaded unarmed contains no
+ * wrappers at all.
+ *
+ * The wrappers cost one predictable branch until enable() is called.
+ * Once enabled every call is counted and every period'th call of a site
+ * is timed with the cycle counter.  Cycle counts are inclusive of
+ * everything the node evaluates; for Verbs that includes the rest of
+ * the chain after it.  Counters live in per-thread, cache line aligned
+ * chunks so threads never share a line, and dump() folds them together.
+ */
+
+namespace Service {
+    namespace Profile {
+
+        struct Slot {
+            uint64_t calls;
+            uint64_t samples;
+            uint64_t cycles;
+            uint64_t pad;
+        };
+
+        static const uint32_t CHUNK = 1024;     // slots per chunk
+        static const uint32_t CHUNKS = 256;     // sites up to 256K
+
+        struct Counters {
+            Slot *chunk[CHUNKS];
+            Counters *next;
+        };
+
+        struct Site {
+            const char *kind;
+            char *rule;
+        };
+
+        struct State {
+            volatile bool armed;
+            volatile bool enabled;
+            uint32_t period;                    // power of two
+            pthread_mutex_t lock;
+            Site *sites;
+            uint32_t count;
+            uint32_t capacity;
+            Counters *threads;
+        };
+
+        inline State &state() {
+            static State s = { false, false, 64, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0 };
+            return s;
+        }
+
+        inline void arm() { state().armed = true; }
+        inline bool armed() { return state().armed; }
+        inline bool enabled() { return state().enabled; }
+        inline void enable( uint32_t period ) {
+            uint32_t p = 1;
+            while ( p < period ) p <<= 1;
+            state().period = p;
+            state().enabled = true;
+        }
+        inline void disable() { state().enabled = false; }
+
+        /*
+         * Register a profiled node.  rule is copied.
+         */
+        inline uint32_t site( const char *kind, const char *rule ) {
+            State& s = state();
+            pthread_mutex_lock( &s.lock );
+            if ( s.count == s.capacity ) {
+                s.capacity = s.capacity ? s.capacity * 2 : 256;
+                s.sites = (Site *)realloc( s.sites, s.capacity * sizeof(Site) );
+            }
+            uint32_t id = s.count++;
+            s.sites[id].kind = kind;
+            s.sites[id].rule = strdup( rule ? rule : "" );
+            pthread_mutex_unlock( &s.lock );
+            return id;
+        }
+
+        inline Slot *slot( uint32_t id ) {
+            static __thread Counters *counters = 0;
+            if ( id >= CHUNK * CHUNKS ) return 0;
+            if ( counters == 0 ) {
+                counters = (Counters *)calloc( 1, sizeof(Counters) );
+                State& s = state();
+                pthread_mutex_lock( &s.lock );
+                counters->next = s.threads;
+                s.threads = counters;
+                pthread_mutex_unlock( &s.lock );
+            }
+            Slot *&chunk = counters->chunk[id / CHUNK];
+            if ( chunk == 0 ) {
+                void *p;
+                if ( posix_memalign(&p, 64, CHUNK * sizeof(Slot)) != 0 ) return 0;
+                memset( p, 0, CHUNK * sizeof(Slot) );
+                chunk = (Slot *)p;
+            }
+            return &chunk[id % CHUNK];
+        }
+
+        class Probe {
+            Slot *s;
+            uint64_t begin;
+        public:
+            Probe( uint32_t id ) : begin(0) {
+                s = slot( id );
+                if ( s == 0 ) return;
+                if ( (s->calls++ & (state().period - 1)) == 0 ) begin = Trace::ticks();
+            }
+            ~Probe() {
+                if ( begin == 0 ) return;
+                s->cycles += Trace::ticks() - begin;
+                s->samples++;
+            }
+        };
+
+        /*
+         * Write one line per site that has been called:
+         *   id kind calls sampled-calls avg-cycles est-total-cycles rule
+         */
+        inline void dump( OStream& out ) {
+            State& s = state();
+            pthread_mutex_lock( &s.lock );
+            for ( uint32_t id = 0 ; id < s.count ; id++ ) {
+                uint64_t calls = 0, samples = 0, cycles = 0;
+                for ( Counters *c = s.threads ; c ; c = c->next ) {
+                    Slot *chunk = c->chunk[id / CHUNK];
+                    if ( chunk == 0 ) continue;
+                    calls += chunk[id % CHUNK].calls;
+                    samples += chunk[id % CHUNK].samples;
+                    cycles += chunk[id % CHUNK].cycles;
+                }
+                if ( calls == 0 ) continue;
+                uint64_t average = samples ? cycles / samples : 0;
+                out << id << " " << s.sites[id].kind
+                    << " " << calls << " " << samples
+                    << " " << average << " " << average * calls
+                    << " " << s.sites[id].rule << endl;
+            }
+            pthread_mutex_unlock( &s.lock );
+        }
+
+        /*
+         * Zero every thread's counters.  Racy against running threads,
+         * which at worst leaves a call or two counted.
+         */
+        inline void reset() {
+            State& s = state();
+            pthread_mutex_lock( &s.lock );
+            for ( Counters *c = s.threads ; c ; c = c->next ) {
+                for ( uint32_t i = 0 ; i < CHUNKS ; i++ ) {
+                    if ( c->chunk[i] ) memset( c->chunk[i], 0, CHUNK * sizeof(Slot) );
+                }
+            }
+            pthread_mutex_unlock( &s.lock );
+        }
+    }
+
+    class ProfiledPredicate : public Predicate {
+        Predicate *inner;
+        uint32_t id;
+    public:
+        ProfiledPredicate( Predicate *inner, const char *kind, const char *rule )
+        : inner(inner), id(Profile::site(kind, rule)) { }
+        virtual ~ProfiledPredicate() {}
+        virtual void destroy( Pool *pool ) {
+            if ( inner ) inner->destroy( pool );
+            Predicate::destroy( pool );
+        }
+        virtual bool operator() ( Context *context ) {
+            if ( __builtin_expect(Profile::state().enabled == false, 1) ) {
+                return (*inner)( context );
+            }
+            Profile::Probe probe( id );
+            return (*inner)( context );
+        }
+        virtual void depends( Dependencies& d ) { inner->depends( d ); }
+        virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+            return inner->interval( coercion, lo, hi );
+        }
+    };
+
+    class ProfiledIntegerCoercion : public IntegerCoercion {
+        IntegerCoercion *inner;
+        uint32_t id;
+    public:
+        ProfiledIntegerCoercion( IntegerCoercion *inner, const char *kind, const char *rule )
+        : inner(inner), id(Profile::site(kind, rule)) { }
+        virtual ~ProfiledIntegerCoercion() {}
+        virtual void destroy( Pool *pool ) {
+            if ( inner ) inner->destroy( pool );
+            IntegerCoercion::destroy( pool );
+        }
+        virtual uint32_t operator() ( Context *context ) {
+            if ( __builtin_expect(Profile::state().enabled == false, 1) ) {
+                return (*inner)( context );
+            }
+            Profile::Probe probe( id );
+            return (*inner)( context );
+        }
+        virtual void depends( Dependencies& d ) { inner->depends( d ); }
+        virtual const void *identity( uint32_t *kind ) { return inner->identity( kind ); }
+    };
+
+    class ProfiledStringCoercion : public StringCoercion {
+        StringCoercion *inner;
+        uint32_t id;
+    public:
+        ProfiledStringCoercion( StringCoercion *inner, const char *kind, const char *rule )
+        : inner(inner), id(Profile::site(kind, rule)) { }
+        virtual ~ProfiledStringCoercion() {}
+        virtual void destroy( Pool *pool ) {
+            if ( inner ) inner->destroy( pool );
+            StringCoercion::destroy( pool );
+        }
+        virtual String * operator() ( Context *context ) {
+            if ( __builtin_expect(Profile::state().enabled == false, 1) ) {
+                return (*inner)( context );
+            }
+            Profile::Probe probe( id );
+            return (*inner)( context );
+        }
+        virtual void depends( Dependencies& d ) { inner->depends( d ); }
+    };
+
+    class ProfiledVerb : public Verb {
+        Verb *inner;
+        uint32_t id;
+    public:
+        ProfiledVerb( Verb *inner, const char *kind, const char *rule )
+        : Verb(0), inner(inner), id(Profile::site(kind, rule)) { }
+        virtual ~ProfiledVerb() {}
+        virtual void destroy( Pool *pool ) {
+            if ( inner ) inner->destroy( pool );
+            Verb::destroy( pool );
+        }
+        virtual void operator() ( Context& context ) {
+            if ( __builtin_expect(Profile::state().enabled == false, 1) ) {
+                (*inner)( context );
+                return;
+            }
+            Profile::Probe probe( id );
+            (*inner)( context );
+        }
+        virtual void depends( Dependencies& d ) { inner->depends( d ); }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -22,12 +22,17 @@
  */
 
 #include <int_types.h>
+#include <strings.h>
 #include "tcl.h"
 #include "crc32.h"
 #include "MFP.h"
+#include "Numeric.h"
+#include "Chunked.h"
+#include "ReceiveBuffer.h"
+#include "Dependencies.h"
 
-#ifndef _OBJECTPOLICY_H_
-#define _OBJECTPOLICY_H_
+#ifndef _OBJECT_PROGRAM_H_
+#define _OBJECT_PROGRAM_H_
 
 namespace Service {
     using namespace ObjectProcessing;
@@ -44,6 +49,37 @@ namespace Service {
         void operator delete ( void * ) {}
     };
 
+    /*
+     * Everything the connection reuse decisions need about one message,
+     * packed into a single word.  Program::dispose() computes it once per
+     * message while the header Fields are fresh; the caller keeps the
+     * word in its Context so closeOptim, dont_retry and the response
+     * program test bits instead of re-scanning Connection and the
+     * version string.
+     */
+    struct Disposition {
+        enum {
+            HTTP_1_0   = 0x01,
+            HTTP_1_1   = 0x02,
+            CLOSE      = 0x04,      // Connection: close
+            KEEPALIVE  = 0x08,      // Connection: keep-alive
+            UPGRADE    = 0x10,      // Connection: upgrade
+            CONTINUE   = 0x20,      // Expect: 100-continue
+            PERSISTENT = 0x40       // connection may be reused afterwards
+        };
+        uint32_t word;
+
+        Disposition() : word(0) { }
+
+        bool is( uint32_t bits ) const { return (word & bits) != 0; }
+        bool persistent() const { return is( PERSISTENT ); }
+        Context::HTTPVersion version() const {
+            if ( word & HTTP_1_1 ) return Context::HTTP_1_1;
+            if ( word & HTTP_1_0 ) return Context::HTTP_1_0;
+            return Context::HTTP_0_9;
+        }
+    };
+
     class Program {
     protected:
         Field *TRANSFER_ENCODING;
@@ -59,8 +95,9 @@ namespace Service {
         Predicate *connection_has_keepalive;
     
         uint32_t receiveLimit;
+        HeaderSizes headerSizes;
     public:
-        uint32_t contentLength;
+        uint64_t contentLength;
     
         Program()
         : receiveLimit( (20 * 1024) - (4 * 1024) ),
@@ -93,6 +130,83 @@ namespace Service {
         void adjustReceiveLimit( int32_t value ) {
             receiveLimit += value;
         }
+
+        uint32_t getReceiveLimit() const { return receiveLimit; }
+
+        void observeHeaderSize( uint32_t bytes ) { headerSizes.observe( bytes ); }
+        HeaderSizes& headerSizeHistogram() { return headerSizes; }
+
+        /*
+         * Starting receive buffer size for a new connection: enough for
+         * 90% of the header blocks seen so far (4K until there is a
+         * history), never more than receiveLimit.  ReceiveBuffer grows
+         * from there up to receiveLimit.
+         */
+        uint32_t initialReceiveSize() {
+            uint32_t size = headerSizes.percentile( 0.90 );
+            if ( size == 0 ) size = 4 * 1024;
+            return ( size < receiveLimit ) ? size : receiveLimit;
+        }
+
+        /*
+         * The Fields this Program and its policy read.  depends() adds
+         * the Program's own slots and walks the policy; analyze() then
+         * adds the parent of every Field in the set.  When the result
+         * is complete() the parser may skip, and ClearFields(deps) need
+         * not clear, any Field outside it.
+         */
+        virtual void depends( Dependencies& d ) {
+            d.add( TRANSFER_ENCODING );
+            d.add( CONTENT_LENGTH );
+            d.add( Expect );
+            d.add( Range );
+            d.add( CONNECTION );
+            d.add( KeepAlive );
+            d.add( RXDATA );
+            d.add( EoH );
+            if ( connection_has_close ) connection_has_close->depends( d );
+            if ( connection_has_keepalive ) connection_has_keepalive->depends( d );
+        }
+        void analyze( Dependencies& d ) {
+            d.reset();
+            depends( d );
+            for ( uint32_t i = 0 ; i < d.size() ; i++ ) {
+                d.add( d[i]->parent );
+            }
+        }
+
+        /*
+         * Decode CONTENT_LENGTH into contentLength, and into the Field's
+         * value saturated to 32 bits.  Returns false when the header is
+         * absent, malformed or does not fit in 64 bits.
+         */
+        bool decodeContentLength() {
+            contentLength = 0;
+            if ( CONTENT_LENGTH == NULL || CONTENT_LENGTH->count == 0 ) return false;
+            char *s = CONTENT_LENGTH->start;
+            uint32_t length = CONTENT_LENGTH->length;
+            uint64_t value;
+            uint32_t n = Numeric::decimal( s, length, &value );
+            if ( n == 0 ) return false;
+            while ( n < length && (s[n] == ' ' || s[n] == '\t') ) n++;
+            if ( n != length ) return false;
+            CONTENT_LENGTH->value = Numeric::saturate( value );
+            contentLength = value;
+            return true;
+        }
+
+        /*
+         * True when chunked is the final coding in TRANSFER_ENCODING,
+         * in which case the body is framed with a ChunkedDecoder.
+         */
+        bool chunked() {
+            if ( TRANSFER_ENCODING == NULL || TRANSFER_ENCODING->count == 0 ) return false;
+            char *s = TRANSFER_ENCODING->start;
+            uint32_t n = TRANSFER_ENCODING->length;
+            while ( n > 0 && (s[n-1] == ' ' || s[n-1] == '\t') ) n--;
+            if ( n < 7 || strncasecmp(s + n - 7, "chunked", 7) != 0 ) return false;
+            return ( n == 7 || s[n-8] == ',' || s[n-8] == ' ' || s[n-8] == '\t' );
+        }
     
         Context::HTTPVersion
         httpVersion( Field *field ) {
@@ -107,6 +221,53 @@ namespace Service {
             if ( c == '0' ) return Context::HTTP_1_0;
             return Context::HTTP_0_9;
         }
+
+        /*
+         * Bits for the comma separated tokens of a Connection style
+         * header, matched without regard to case.
+         */
+        static uint32_t connectionTokens( Field *field ) {
+            if ( field == NULL || field->count == 0 ) return 0;
+            uint32_t bits = 0;
+            char *s = field->start, *end = s + field->length;
+            while ( s < end ) {
+                while ( s < end && (*s == ' ' || *s == '\t' || *s == ',') ) s++;
+                char *token = s;
+                while ( s < end && *s != ',' && *s != ' ' && *s != '\t' ) s++;
+                uint32_t n = s - token;
+                if ( n == 5 && strncasecmp(token, "close", 5) == 0 ) bits |= Disposition::CLOSE;
+                else if ( n == 10 && strncasecmp(token, "keep-alive", 10) == 0 ) bits |= Disposition::KEEPALIVE;
+                else if ( n == 7 && strncasecmp(token, "upgrade", 7) == 0 ) bits |= Disposition::UPGRADE;
+            }
+            return bits;
+        }
+
+        /*
+         * Compute the disposition of the current message from its
+         * version Field and the Connection and Expect Fields.  Returned
+         * by value: the Program is shared, the word belongs in the
+         * caller's Context.
+         */
+        Disposition dispose( Field *version ) {
+            Disposition disposition;
+            uint32_t word = 0;
+            switch ( httpVersion(version) ) {
+            case Context::HTTP_1_1: word |= Disposition::HTTP_1_1; break;
+            case Context::HTTP_1_0: word |= Disposition::HTTP_1_0; break;
+            default: break;
+            }
+            word |= connectionTokens( CONNECTION );
+            if ( Expect && Expect->count && Expect->length == 12 &&
+                 strncasecmp(Expect->start, "100-continue", 12) == 0 ) {
+                word |= Disposition::CONTINUE;
+            }
+            if ( (word & Disposition::CLOSE) == 0 ) {
+                if ( word & Disposition::HTTP_1_1 ) word |= Disposition::PERSISTENT;
+                else if ( word & Disposition::KEEPALIVE ) word |= Disposition::PERSISTENT;
+            }
+            disposition.word = word;
+            return disposition;
+        }
     };
 
     class RequestProgram : public Program {
@@ -132,6 +293,17 @@ namespace Service {
         void set_REQUEST_VERSION( Field *ff ) { REQUEST_VERSION = ff; }
         void set_method_is_head( Predicate *ff ) { method_is_head = ff; }
 
+        virtual void depends( Dependencies& d ) {
+            Program::depends( d );
+            d.add( METHOD );
+            d.add( REQUEST_VERSION );
+            if ( method_is_head ) method_is_head->depends( d );
+            if ( block ) block->depends( d );
+        }
+
+        using Program::dispose;
+        Disposition dispose() { return dispose( REQUEST_VERSION ); }
+
         void setHost( char *_host ) {
             host = (char *)malloc( strlen(_host)+1 );
             strcpy( host, _host );
@@ -165,6 +337,17 @@ namespace Service {
         void set_RESPONSE_VERSION( Field *ff ) { RESPONSE_VERSION = ff; }
         void set_RESPONSE_CODE( Field *ff ) { RESPONSE_CODE = ff; }
 
+        virtual void depends( Dependencies& d ) {
+            Program::depends( d );
+            d.add( Upgrade );
+            d.add( RESPONSE_VERSION );
+            d.add( RESPONSE_CODE );
+            if ( block ) block->depends( d );
+        }
+
+        using Program::dispose;
+        Disposition dispose() { return dispose( RESPONSE_VERSION ); }
+
         virtual void operator () (Context *);
     };
 
@@ -0,0 +1,275 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_RECEIVEBUFFER_H_
+#define _OBJECT_RECEIVEBUFFER_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "tcl.h"
+
+/*
+ * Adaptive receive buffers.
+ *
+ * A Program records the size of the header blocks it sees in a sampled
+ * HeaderSizes histogram.  New connections start with a buffer from the
+ * smallest class that covers most observed headers and grow it
+ * geometrically, one class at a time, while a header does not fit, up
+ * to the Program's receiveLimit.  Buffers come from per-class free
+ * lists in BufferClasses so growing does not go back to malloc().
+ */
+
+namespace Service {
+
+    class HeaderSizes {
+    public:
+        static const uint32_t GRANULE = 512;
+        static const uint32_t BUCKETS = 64;     // the last one collects everything above 32K
+        static const uint32_t SAMPLE = 16;      // power of two, one header in SAMPLE per thread
+        static const uint32_t TICKS = 64;       // power of two, per thread sampling counters
+
+    private:
+        volatile uint64_t bucket[BUCKETS];
+        uint32_t id;                            // selects this histogram's counter
+
+        static uint32_t *ticks() {
+            static __thread uint32_t tick[TICKS];
+            return tick;
+        }
+
+    public:
+        HeaderSizes() {
+            static uint32_t serial = 0;
+            id = __sync_fetch_and_add( &serial, 1 ) & (TICKS - 1);
+            for ( uint32_t i = 0 ; i < BUCKETS ; i++ ) bucket[i] = 0;
+        }
+
+        /*
+         * Only every SAMPLE'th call on each thread touches the shared
+         * buckets; the others cost a thread local increment.  Each
+         * histogram counts in its own per thread slot, so a thread that
+         * alternates between request and response histograms samples
+         * both of them.  Histograms share a slot only when TICKS of them
+         * were created in between.
+         */
+        void observe( uint32_t bytes ) {
+            uint32_t& tick = ticks()[id];
+            if ( (tick++ & (SAMPLE - 1)) != 0 ) return;
+            uint32_t i = bytes / GRANULE;
+            if ( i >= BUCKETS ) i = BUCKETS - 1;
+            __sync_fetch_and_add( &bucket[i], 1 );
+        }
+
+        /*
+         * Number of samples taken.
+         */
+        uint64_t count() const {
+            uint64_t n = 0;
+            for ( uint32_t i = 0 ; i < BUCKETS ; i++ ) n += bucket[i];
+            return n;
+        }
+
+        /*
+         * Smallest size that covers the given fraction of sampled
+         * headers, rounded up to a GRANULE.  Zero before anything has
+         * been sampled.
+         */
+        uint32_t percentile( double fraction ) const {
+            uint64_t n = count();
+            if ( n == 0 ) return 0;
+            double exact = fraction * n;
+            uint64_t want = (uint64_t)exact;
+            if ( want < exact ) want++;         // ceil
+            if ( want == 0 ) want = 1;
+            uint64_t seen = 0;
+            for ( uint32_t i = 0 ; i < BUCKETS ; i++ ) {
+                seen += bucket[i];
+                if ( seen >= want ) return (i + 1) * GRANULE;
+            }
+            return BUCKETS * GRANULE;
+        }
+
+        void snapshot( uint64_t *out ) const {
+            for ( uint32_t i = 0 ; i < BUCKETS ; i++ ) out[i] = bucket[i];
+        }
+
+        /*
+         * One "upper-bound count" line per non-empty bucket.
+         */
+        void dump( OStream& out ) const {
+            for ( uint32_t i = 0 ; i < BUCKETS ; i++ ) {
+                if ( bucket[i] == 0 ) continue;
+                if ( i == BUCKETS - 1 ) out << "+inf";
+                else                    out << (i + 1) * GRANULE;
+                out << " " << bucket[i] << endl;
+            }
+        }
+
+        void reset() {
+            for ( uint32_t i = 0 ; i < BUCKETS ; i++ ) bucket[i] = 0;
+        }
+    };
+
+    /*
+     * Power of two buffer classes from 1K to 64K with a free list each.
+     */
+    class BufferClasses {
+    public:
+        static const uint32_t SMALLEST = 1024;
+        static const uint32_t CLASSES = 7;
+        static const uint32_t KEEP = 4096;      // free buffers kept per class
+
+    private:
+        struct Free {
+            Free *next;
+        };
+        struct Class {
+            pthread_mutex_t lock;
+            Free *free;
+            uint32_t count;
+        };
+        Class classes[CLASSES];
+
+    public:
+        BufferClasses() {
+            for ( uint32_t i = 0 ; i < CLASSES ; i++ ) {
+                pthread_mutex_init( &classes[i].lock, NULL );
+                classes[i].free = 0;
+                classes[i].count = 0;
+            }
+        }
+        ~BufferClasses() {
+            for ( uint32_t i = 0 ; i < CLASSES ; i++ ) {
+                while ( classes[i].free ) {
+                    Free *f = classes[i].free;
+                    classes[i].free = f->next;
+                    free( f );
+                }
+                pthread_mutex_destroy( &classes[i].lock );
+            }
+        }
+
+        static BufferClasses &shared() {
+            static BufferClasses instance;
+            return instance;
+        }
+
+        static uint32_t size( uint32_t c ) { return SMALLEST << c; }
+
+        /*
+         * Smallest class of at least bytes, or CLASSES if none is.
+         */
+        static uint32_t fit( uint32_t bytes ) {
+            uint32_t c = 0;
+            while ( c < CLASSES && size(c) < bytes ) c++;
+            return c;
+        }
+
+        char *get( uint32_t c ) {
+            Class& k = classes[c];
+            pthread_mutex_lock( &k.lock );
+            Free *f = k.free;
+            if ( f ) {
+                k.free = f->next;
+                k.count--;
+            }
+            pthread_mutex_unlock( &k.lock );
+            if ( f ) return (char *)f;
+            return (char *)malloc( size(c) );
+        }
+
+        void put( uint32_t c, char *buffer ) {
+            Class& k = classes[c];
+            pthread_mutex_lock( &k.lock );
+            if ( k.count < KEEP ) {
+                Free *f = (Free *)buffer;
+                f->next = k.free;
+                k.free = f;
+                k.count++;
+                buffer = 0;
+            }
+            pthread_mutex_unlock( &k.lock );
+            if ( buffer ) free( buffer );
+        }
+    };
+
+    /*
+     * One connection's receive buffer.
+     */
+    class ReceiveBuffer {
+        BufferClasses& classes;
+        uint32_t limit;
+        uint32_t c;
+    public:
+        char *data;
+        uint32_t used;
+
+        ReceiveBuffer( BufferClasses& classes, uint32_t initial, uint32_t limit )
+        : classes(classes), limit(limit), c(0), data(0), used(0) {
+            if ( initial > limit ) initial = limit;
+            c = BufferClasses::fit( initial );
+            if ( c == BufferClasses::CLASSES ) c--;
+            data = classes.get( c );
+        }
+        ~ReceiveBuffer() {
+            if ( data ) classes.put( c, data );
+        }
+
+        /*
+         * False if the initial buffer could not be allocated; such a
+         * buffer has no capacity and never grows.
+         */
+        bool valid() const { return data != 0; }
+
+        /*
+         * Usable capacity: the class size, but never above the limit.
+         */
+        uint32_t capacity() const {
+            if ( data == 0 ) return 0;
+            uint32_t size = BufferClasses::size( c );
+            return ( size < limit ) ? size : limit;
+        }
+
+        /*
+         * Move to the next class up, keeping what has been received.
+         * Returns false once the limit (or the largest class) has been
+         * reached, at which point the header is too large.
+         */
+        bool grow() {
+            if ( data == 0 ) return false;
+            if ( capacity() >= limit || c + 1 == BufferClasses::CLASSES ) return false;
+            char *bigger = classes.get( c + 1 );
+            if ( bigger == 0 ) return false;
+            memcpy( bigger, data, used );
+            classes.put( c, data );
+            data = bigger;
+            c++;
+            return true;
+        }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,711 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_REGEX_H_
+#define _OBJECT_REGEX_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "tcl.h"
+
+/*
+ * Linear time regular expressions.
+ *
+ * The pattern is compiled to a Thompson NFA: literals, '.', bracket
+ * classes, the \d \w \s escapes (and their upper case complements),
+ * grouping, '|', '*', '+' and '?'.  A '?' after a repetition (lazy, as
+ * in "x+?") matches the same subjects and is accepted; any other
+ * repeated repetition ("x**") is "nothing to repeat".  A leading '^'
+ * and a trailing '$'
+ * anchor the match; without them the pattern may match anywhere in the
+ * subject.  There are no back references and no counted repetition, so
+ * there is nothing that needs backtracking.
+ *
+ * Matching runs a lazily built DFA: each DFA state is a set of NFA
+ * states, built the first time a byte leads out of its predecessor and
+ * cached in a fixed block.  When the block is full it is flushed and
+ * refilled, so memory is bounded and every byte of the subject costs at
+ * most one state construction, O(pattern size).  Matching is O(subject
+ * length) for any subject.
+ *
+ * The NFA is read only once compiled.  Its node and class arrays are
+ * sized to the pattern and malloc()ed rather than taken from the Pool,
+ * so that release() can hand them back when the predicate is destroyed.
+ *
+ * Each thread that evaluates the predicate gets its own DFA cache,
+ * malloc()ed on first use, so matching takes no lock.  The caches are
+ * not taken from the Pool either: a Pool is not safe to allocate from
+ * concurrently, and a cache has to be freed when its thread exits or
+ * is flushed, neither of which a Pool can do.  Every Regex holds a small id, recycled by release();
+ * each thread keeps a table of its caches indexed by that id, under one
+ * process wide pthread key, and frees it when the thread exits.  A
+ * cache left behind by a released Regex is recognized by its serial
+ * number and freed by its thread when the id is reused.  If a cache
+ * cannot be set up the Regex simulates the NFA directly, which is still
+ * linear, just slower per byte.
+ */
+
+namespace Service {
+
+    class Regex {
+    public:
+        static const uint32_t MAX_NODES = 1024;
+        static const uint32_t MAX_CLASSES = 512;
+        static const uint32_t BUCKETS = 256;
+    private:
+        enum { CHAR, SPLIT, EMPTY, MATCH };
+        struct Node {
+            uint8_t op;
+            uint16_t cls;
+            uint16_t out;
+            uint16_t out1;
+        };
+        struct Class {
+            uint32_t bits[8];
+            bool has( uint8_t c ) const { return (bits[c >> 5] >> (c & 31)) & 1; }
+            void add( uint8_t c ) { bits[c >> 5] |= 1u << (c & 31); }
+            void invert() { for ( int i = 0 ; i < 8 ; i++ ) bits[i] = ~bits[i]; }
+            void merge( const Class& that ) { for ( int i = 0 ; i < 8 ; i++ ) bits[i] |= that.bits[i]; }
+        };
+        struct Fragment {
+            uint16_t start;
+            uint16_t end;           // an EMPTY node whose out is patched
+        };
+
+        /*
+         * A set of NFA states: the CHAR and MATCH nodes reached after
+         * following every SPLIT and EMPTY, in node order.
+         */
+        struct Set {
+            uint16_t count;
+            bool match;
+            uint16_t list[MAX_NODES];
+            uint8_t mark[MAX_NODES];
+        };
+
+        struct State {
+            State *next[256];
+            State *chain;
+            uint32_t hash;
+            uint16_t count;
+            bool match;
+            uint16_t node[1];
+        };
+
+        /*
+         * One thread's DFA cache.  block holds the buckets and the States.
+         */
+        struct Cache {
+            uint64_t serial;        // of the Regex it was built for
+            char *block;
+            uint32_t used;
+            State **bucket;
+            State *initial;
+        };
+
+        /*
+         * One thread's caches, indexed by Regex id.
+         */
+        struct Table {
+            Cache **cache;
+            uint32_t size;
+        };
+
+        /*
+         * Process wide id allocation and the thread key.
+         */
+        struct Registry {
+            pthread_mutex_t lock;
+            uint32_t *free;         // released ids
+            uint32_t freed;
+            uint32_t capacity;
+            uint32_t next;
+            uint64_t serial;
+            pthread_key_t key;
+            bool keyed;
+        };
+        static Registry& registry() {
+            static Registry r = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, pthread_key_t(), false };
+            return r;
+        }
+        static pthread_once_t& once() {
+            static pthread_once_t o = PTHREAD_ONCE_INIT;
+            return o;
+        }
+        static void createKey() {
+            registry().keyed = ( pthread_key_create(&registry().key, retire) == 0 );
+        }
+        static void retire( void *arg ) {
+            Table *t = (Table *)arg;
+            for ( uint32_t i = 0 ; i < t->size ; i++ ) {
+                if ( t->cache[i] == 0 ) continue;
+                free( t->cache[i]->block );
+                free( t->cache[i] );
+            }
+            free( t->cache );
+            free( t );
+        }
+
+        Node *node;
+        Class *cls;
+        uint32_t nodes;
+        uint32_t classes;
+        uint32_t nodeCapacity;
+        uint32_t classCapacity;
+        uint16_t start;
+        bool anchoredStart;
+        bool anchoredEnd;
+        const char *failure;
+
+        // per thread lazy DFA caches
+        uint32_t cacheBytes;
+        uint32_t id;
+        uint64_t serial;            // 0 once released
+
+        // compile time only
+        const char *p;
+        const char *limit;
+
+        uint16_t add( uint8_t op, uint16_t c = 0, uint16_t out = 0, uint16_t out1 = 0 ) {
+            if ( nodes == nodeCapacity ) {
+                failure = "pattern too large";
+                return 0;
+            }
+            Node& n = node[nodes];
+            n.op = op;
+            n.cls = c;
+            n.out = out;
+            n.out1 = out1;
+            return nodes++;
+        }
+        uint16_t addClass( const Class& c ) {
+            if ( classes == classCapacity ) {
+                failure = "too many character classes";
+                return 0;
+            }
+            cls[classes] = c;
+            return classes++;
+        }
+        Fragment fragment( const Class& c ) {
+            Fragment f;
+            f.end = add( EMPTY );
+            f.start = add( CHAR, addClass(c), f.end );
+            return f;
+        }
+        Fragment empty() {
+            Fragment f;
+            f.start = f.end = add( EMPTY );
+            return f;
+        }
+        void patch( Fragment& f, uint16_t to ) { node[f.end].out = to; }
+
+        static void range( Class& c, int from, int to ) {
+            for ( int i = from ; i <= to ; i++ ) c.add( (uint8_t)i );
+        }
+        /*
+         * Class for the escape at p (after the backslash).
+         */
+        Class escape() {
+            Class c;
+            memset( &c, 0, sizeof(c) );
+            if ( p == limit ) {
+                failure = "trailing backslash";
+                return c;
+            }
+            char e = *p++;
+            switch ( e ) {
+            case 'd': case 'D':
+                range( c, '0', '9' );
+                break;
+            case 'w': case 'W':
+                range( c, '0', '9' ); range( c, 'a', 'z' ); range( c, 'A', 'Z' ); c.add( '_' );
+                break;
+            case 's': case 'S':
+                c.add( ' ' ); c.add( '\t' ); c.add( '\r' ); c.add( '\n' ); c.add( '\f' ); c.add( '\v' );
+                break;
+            case 'n': c.add( '\n' ); return c;
+            case 'r': c.add( '\r' ); return c;
+            case 't': c.add( '\t' ); return c;
+            default:  c.add( (uint8_t)e ); return c;
+            }
+            if ( e == 'D' || e == 'W' || e == 'S' ) c.invert();
+            return c;
+        }
+        Class bracket() {
+            Class c;
+            memset( &c, 0, sizeof(c) );
+            bool negate = false;
+            if ( p < limit && *p == '^' ) {
+                negate = true;
+                p++;
+            }
+            bool first = true;
+            while ( p < limit && (*p != ']' || first) ) {
+                first = false;
+                int lo;
+                if ( *p == '\\' ) {
+                    p++;
+                    const char *at = p;
+                    Class e = escape();
+                    if ( failure ) return c;
+                    if ( *at == 'd' || *at == 'D' || *at == 'w' || *at == 'W' || *at == 's' || *at == 'S' ) {
+                        c.merge( e );
+                        continue;
+                    }
+                    lo = (uint8_t)p[-1];
+                    if ( *at == 'n' ) lo = '\n';
+                    else if ( *at == 'r' ) lo = '\r';
+                    else if ( *at == 't' ) lo = '\t';
+                } else {
+                    lo = (uint8_t)*p++;
+                }
+                if ( p + 1 < limit && *p == '-' && p[1] != ']' ) {
+                    p++;
+                    int hi = (uint8_t)*p++;
+                    if ( hi < lo ) {
+                        failure = "bad range in class";
+                        return c;
+                    }
+                    range( c, lo, hi );
+                } else {
+                    c.add( (uint8_t)lo );
+                }
+            }
+            if ( p == limit ) {
+                failure = "missing ]";
+                return c;
+            }
+            p++;
+            if ( negate ) c.invert();
+            return c;
+        }
+
+        Fragment atom() {
+            char c = *p++;
+            Class k;
+            memset( &k, 0, sizeof(k) );
+            switch ( c ) {
+            case '(': {
+                Fragment f = alternation();
+                if ( failure ) return f;
+                if ( p == limit || *p != ')' ) {
+                    failure = "missing )";
+                    return f;
+                }
+                p++;
+                return f;
+            }
+            case '[':
+                return fragment( bracket() );
+            case '.':
+                k.invert();
+                return fragment( k );
+            case '\\':
+                return fragment( escape() );
+            case '*': case '+': case '?':
+                failure = "nothing to repeat";
+                return empty();
+            default:
+                k.add( (uint8_t)c );
+                return fragment( k );
+            }
+        }
+        Fragment repetition() {
+            Fragment f = atom();
+            bool repeated = false, lazy = false;
+            while ( p < limit && failure == 0 && (*p == '*' || *p == '+' || *p == '?') ) {
+                if ( repeated ) {
+                    if ( *p == '?' && lazy == false ) {     // lazy: same subjects match
+                        p++;
+                        lazy = true;
+                        continue;
+                    }
+                    failure = "nothing to repeat";
+                    break;
+                }
+                repeated = true;
+                char op = *p++;
+                Fragment r;
+                r.end = add( EMPTY );
+                uint16_t split = add( SPLIT, 0, f.start, r.end );
+                switch ( op ) {
+                case '*':
+                    patch( f, split );
+                    r.start = split;
+                    break;
+                case '+':
+                    patch( f, split );
+                    r.start = f.start;
+                    break;
+                case '?':
+                    patch( f, r.end );
+                    r.start = split;
+                    break;
+                }
+                f = r;
+            }
+            return f;
+        }
+        Fragment concatenation() {
+            Fragment f = empty();
+            while ( p < limit && failure == 0 && *p != '|' && *p != ')' ) {
+                Fragment next = repetition();
+                patch( f, next.start );
+                f.end = next.end;
+            }
+            return f;
+        }
+        Fragment alternation() {
+            Fragment f = concatenation();
+            while ( p < limit && failure == 0 && *p == '|' ) {
+                p++;
+                Fragment g = concatenation();
+                Fragment r;
+                r.start = add( SPLIT, 0, f.start, g.start );
+                r.end = add( EMPTY );
+                patch( f, r.end );
+                patch( g, r.end );
+                f = r;
+            }
+            return f;
+        }
+
+        void closure( uint16_t from, Set& set, uint16_t *stack ) const {
+            uint32_t sp = 0;
+            stack[sp++] = from;
+            while ( sp > 0 ) {
+                uint16_t n = stack[--sp];
+                if ( set.mark[n] ) continue;
+                set.mark[n] = 1;
+                const Node& x = node[n];
+                if ( x.op == SPLIT ) {
+                    stack[sp++] = x.out1;
+                    stack[sp++] = x.out;
+                } else if ( x.op == EMPTY ) {
+                    stack[sp++] = x.out;
+                }
+            }
+        }
+        void collect( Set& set ) const {
+            set.count = 0;
+            set.match = false;
+            for ( uint32_t n = 0 ; n < nodes ; n++ ) {
+                if ( set.mark[n] == 0 ) continue;
+                if ( node[n].op == CHAR ) set.list[set.count++] = n;
+                else if ( node[n].op == MATCH ) {
+                    set.list[set.count++] = n;
+                    set.match = true;
+                }
+            }
+        }
+        void begin( Set& set, uint16_t *stack ) const {
+            memset( set.mark, 0, nodes );
+            closure( start, set, stack );
+            collect( set );
+        }
+        void step( const uint16_t *list, uint32_t count, uint8_t c, Set& to, uint16_t *stack ) const {
+            memset( to.mark, 0, nodes );
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                const Node& x = node[list[i]];
+                if ( x.op == CHAR && cls[x.cls].has(c) ) closure( x.out, to, stack );
+            }
+            if ( anchoredStart == false ) closure( start, to, stack );
+            collect( to );
+        }
+
+        static void *allocate( Cache& c, uint32_t size, uint32_t bytes ) {
+            bytes = (bytes + 7) & ~7u;
+            if ( c.used + bytes > size ) return 0;
+            void *result = c.block + c.used;
+            c.used += bytes;
+            return result;
+        }
+        void flush( Cache& c ) const {
+            c.used = 0;
+            c.bucket = (State **)allocate( c, cacheBytes, BUCKETS * sizeof(State *) );
+            memset( c.bucket, 0, BUCKETS * sizeof(State *) );
+            c.initial = 0;
+        }
+        State *intern( Cache& c, const Set& set ) const {
+            uint32_t h = 2166136261u;
+            for ( uint32_t i = 0 ; i < set.count ; i++ ) {
+                h = (h ^ set.list[i]) * 16777619u;
+            }
+            State **chain = &c.bucket[h & (BUCKETS - 1)];
+            for ( State *s = *chain ; s ; s = s->chain ) {
+                if ( s->hash != h || s->count != set.count ) continue;
+                if ( memcmp(s->node, set.list, set.count * sizeof(uint16_t)) == 0 ) return s;
+            }
+            uint32_t bytes = sizeof(State) + set.count * sizeof(uint16_t);
+            State *s = (State *)allocate( c, cacheBytes, bytes );
+            if ( s == 0 ) return 0;
+            memset( s->next, 0, sizeof(s->next) );
+            s->hash = h;
+            s->count = set.count;
+            s->match = set.match;
+            memcpy( s->node, set.list, set.count * sizeof(uint16_t) );
+            s->chain = *chain;
+            *chain = s;
+            return s;
+        }
+        State *remember( Cache& c, const Set& set ) const {
+            State *s = intern( c, set );
+            if ( s ) return s;
+            UTRACE( 4, "Regex: state cache full, flushing" );
+            flush( c );
+            return intern( c, set );
+        }
+
+        /*
+         * The calling thread's cache, created on first use.  NULL if
+         * there is no key or no memory.
+         */
+        Cache *local() {
+            Registry& r = registry();
+            if ( serial == 0 || r.keyed == false ) return 0;
+            Table *t = (Table *)pthread_getspecific( r.key );
+            if ( t && id < t->size && t->cache[id] && t->cache[id]->serial == serial ) {
+                return t->cache[id];
+            }
+            if ( t == 0 ) {
+                t = (Table *)calloc( 1, sizeof(Table) );
+                if ( t == 0 ) return 0;
+                if ( pthread_setspecific(r.key, t) != 0 ) {
+                    free( t );
+                    return 0;
+                }
+            }
+            if ( id >= t->size ) {
+                uint32_t size = t->size ? t->size : 16;
+                while ( size <= id ) size *= 2;
+                Cache **grown = (Cache **)realloc( t->cache, size * sizeof(Cache *) );
+                if ( grown == 0 ) return 0;
+                memset( grown + t->size, 0, (size - t->size) * sizeof(Cache *) );
+                t->cache = grown;
+                t->size = size;
+            }
+            Cache *c = t->cache[id];
+            if ( c ) {                  // left by a released Regex
+                free( c->block );
+                free( c );
+                t->cache[id] = 0;
+            }
+            c = (Cache *)malloc( sizeof(Cache) );
+            if ( c == 0 ) return 0;
+            c->block = (char *)malloc( cacheBytes );
+            if ( c->block == 0 ) {
+                free( c );
+                return 0;
+            }
+            c->serial = serial;
+            flush( *c );
+            t->cache[id] = c;
+            return c;
+        }
+
+        /*
+         * Direct NFA simulation, used when there is no cache.
+         */
+        bool simulate( const char *s, uint32_t length ) const {
+            Set sets[2];
+            Set *a = &sets[0], *b = &sets[1];
+            uint16_t stack[2 * MAX_NODES + 1];
+            begin( *a, stack );
+            bool result = false;
+            for ( uint32_t i = 0 ; ; i++ ) {
+                if ( a->match && anchoredEnd == false ) {
+                    result = true;
+                    break;
+                }
+                if ( i == length ) {
+                    result = a->match;
+                    break;
+                }
+                if ( a->count == 0 && anchoredStart ) break;
+                step( a->list, a->count, (uint8_t)s[i], *b, stack );
+                Set *t = a; a = b; b = t;
+            }
+            return result;
+        }
+    public:
+        /*
+         * pool is not used; see above.
+         */
+        Regex( Pool *pool, const char *pattern, uint32_t bytes = 64 * 1024 )
+        : node(0), cls(0), nodes(0), classes(0), nodeCapacity(0), classCapacity(0),
+          start(0), anchoredStart(false), anchoredEnd(false),
+          failure(0), cacheBytes(0), id(0), serial(0) {
+            uint32_t n = strlen( pattern );
+            p = pattern;
+            limit = pattern + n;
+            if ( p < limit && *p == '^' ) {
+                anchoredStart = true;
+                p++;
+            }
+            if ( limit > p && limit[-1] == '$' ) {
+                // escaped only by an odd run of backslashes
+                const char *b = limit - 1;
+                while ( b > p && b[-1] == '\\' ) b--;
+                if ( ((limit - 1 - b) & 1) == 0 ) {
+                    anchoredEnd = true;
+                    limit--;
+                }
+            }
+            // every pattern byte adds at most three nodes ('|') and one class
+            uint32_t length = limit - p;
+            nodeCapacity = 3 * length + 2;
+            if ( nodeCapacity > MAX_NODES ) nodeCapacity = MAX_NODES;
+            classCapacity = length ? length : 1;
+            if ( classCapacity > MAX_CLASSES ) classCapacity = MAX_CLASSES;
+            node = (Node *)malloc( nodeCapacity * sizeof(Node) );
+            cls = (Class *)malloc( classCapacity * sizeof(Class) );
+            if ( node == 0 || cls == 0 ) {
+                failure = "out of memory";
+            } else {
+                Fragment f = alternation();
+                if ( failure == 0 && p != limit ) failure = "unbalanced )";
+                if ( failure == 0 ) {
+                    patch( f, add(MATCH) );
+                    start = f.start;
+                }
+            }
+            if ( failure ) {
+                UINFO( 2, "Regex: " << failure << " in " << pattern << endl );
+                return;
+            }
+            uint32_t least = BUCKETS * sizeof(State *) + 16 * (sizeof(State) + nodes * sizeof(uint16_t));
+            cacheBytes = bytes < least ? least : bytes;
+            pthread_once( &once(), createKey );
+            Registry& r = registry();
+            if ( r.keyed == false ) {
+                UTRACE( 2, "Regex: no thread key, simulating the NFA" );
+                return;
+            }
+            pthread_mutex_lock( &r.lock );
+            id = r.freed ? r.free[--r.freed] : r.next++;
+            serial = ++r.serial;
+            pthread_mutex_unlock( &r.lock );
+        }
+        ~Regex() {}
+
+        /*
+         * Free the compiled pattern and give the id back.  Call once no
+         * thread evaluates the Regex any more; the threads' caches for it
+         * are freed lazily.  A released Regex matches nothing.
+         */
+        void release() {
+            if ( node ) free( node );
+            if ( cls ) free( cls );
+            node = 0;
+            cls = 0;
+            if ( failure == 0 ) failure = "released";
+            if ( serial == 0 ) return;
+            Registry& r = registry();
+            pthread_mutex_lock( &r.lock );
+            if ( r.freed == r.capacity ) {
+                uint32_t size = r.capacity ? r.capacity * 2 : 64;
+                uint32_t *grown = (uint32_t *)realloc( r.free, size * sizeof(uint32_t) );
+                if ( grown ) {
+                    r.free = grown;
+                    r.capacity = size;
+                }
+            }
+            if ( r.freed < r.capacity ) r.free[r.freed++] = id;     // else the id is lost
+            pthread_mutex_unlock( &r.lock );
+            serial = 0;
+        }
+
+        bool valid() const { return failure == 0; }
+        const char *error() const { return failure; }
+
+        bool match( const char *s, uint32_t length ) {
+            if ( failure ) return false;
+            Cache *cache = local();
+            if ( cache == 0 ) return simulate( s, length );
+            Set set;
+            uint16_t stack[2 * MAX_NODES + 1];
+            if ( cache->initial == 0 ) {
+                begin( set, stack );
+                cache->initial = remember( *cache, set );
+            }
+            State *state = cache->initial;
+            bool result = false;
+            for ( uint32_t i = 0 ; ; i++ ) {
+                if ( state->match && anchoredEnd == false ) {
+                    result = true;
+                    break;
+                }
+                if ( i == length ) {
+                    result = state->match;
+                    break;
+                }
+                if ( state->count == 0 && anchoredStart ) break;
+                uint8_t c = (uint8_t)s[i];
+                State *next = state->next[c];
+                if ( next == 0 ) {
+                    step( state->node, state->count, c, set, stack );
+                    next = intern( *cache, set );
+                    if ( next ) {
+                        state->next[c] = next;
+                    } else {
+                        UTRACE( 4, "Regex: state cache full, flushing" );
+                        flush( *cache );
+                        next = intern( *cache, set );
+                    }
+                }
+                state = next;
+            }
+            return result;
+        }
+    };
+
+    class RegexMatches : public Predicate {
+        StringCoercion *coercion;
+        Regex regex;
+    public:
+        RegexMatches( Pool *pool, StringCoercion *coercion, const char *pattern,
+                      uint32_t cacheBytes = 64 * 1024 )
+        : coercion(coercion), regex(pool, pattern, cacheBytes) { }
+        virtual ~RegexMatches() {}
+        virtual void destroy( Pool *pool ) {
+            UTRACE( 8, "Predicate::RegexMatches: destroy" );
+            regex.release();
+            coercion->destroy( pool );
+            Predicate::destroy( pool );
+        }
+        virtual bool operator() ( Context *context ) {
+            String *s = (*coercion)( context );
+            if ( s->start == 0 ) return false;
+            return regex.match( s->start, s->length );
+        }
+        virtual void depends( Dependencies& d ) { coercion->depends( d ); }
+
+        bool valid() const { return regex.valid(); }
+        const char *error() const { return regex.error(); }
+    };
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,294 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_RELOAD_H_
+#define _OBJECT_RELOAD_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include "tcl.h"
+
+/*
+ * Incremental policy reload.
+ *
+ * Initialize() compiles every rule from its Tcl definition each time the
+ * policy is loaded, and the old Program is torn down with destroy().  A
+ * Reload::Cache remembers compiled rule subtrees by a hash of their
+ * source text, so a reload compiles only the rules whose text changed:
+ *
+ *     cache.begin();
+ *     ... for each rule:
+ *         Predicate *p = cache.predicate( pool, fields, source, length, builder );
+ *     ... swap in the new Program, destroy the old one ...
+ *     cache.sweep();
+ *
+ * A compiled subtree holds the Field pointers of the Program it was
+ * built for, so every lookup also names that binding -- the Program's
+ * Field table, or whatever else identifies where its Fields live.  A
+ * subtree is reused only under the same binding; a caller that wants
+ * reuse across reloads keeps its Field table across generations and
+ * passes it each time.
+ *
+ * Cached subtrees are compiled into the cache's own Pool, which must
+ * outlive every generation, and are handed out wrapped in a Shared
+ * proxy allocated from the caller's Pool.  A Verb is cached on its own,
+ * never with its tail: the Builder builds it with a NULL next, and the
+ * SharedVerb proxy carries the next Verb of the chain it is put in.  Destroying a generation
+ * destroys only the proxies; sweep() destroys the subtrees that the
+ * current generation did not ask for.  Glob automata, address tables
+ * and interned Atoms inside a reused subtree are reused with it.
+ *
+ * Like the rest of policy loading, none of this is thread safe; it runs
+ * on the interpreter thread.
+ */
+
+namespace Service {
+    namespace Reload {
+
+        inline uint64_t hash( const char *s, uint32_t length ) {
+            uint64_t h = 14695981039346656037ULL;
+            for ( uint32_t i = 0 ; i < length ; i++ ) {
+                h ^= (uint8_t)s[i];
+                h *= 1099511628211ULL;
+            }
+            return h;
+        }
+
+        template <class T>
+        class Builder {
+        public:
+            virtual ~Builder() {}
+            virtual T *operator () ( Pool * ) = 0;
+        };
+
+        class SharedPredicate : public Predicate {
+            Predicate *inner;
+        public:
+            SharedPredicate( Predicate *inner ) : inner(inner) { }
+            virtual ~SharedPredicate() {}
+            virtual void destroy( Pool *pool ) {
+                UTRACE( 8, "Predicate::SharedPredicate: destroy" );
+                Predicate::destroy( pool );     // inner belongs to the Cache
+            }
+            virtual bool operator() ( Context *context ) { return (*inner)( context ); }
+            virtual void depends( Dependencies& d ) { inner->depends( d ); }
+            virtual bool interval( IntegerCoercion **coercion, uint64_t *lo, uint64_t *hi ) {
+                return inner->interval( coercion, lo, hi );
+            }
+        };
+
+        class SharedVerb : public Verb {
+            Verb *inner;
+        public:
+            SharedVerb( Verb *inner, Verb *next ) : Verb(next), inner(inner) { }
+            virtual ~SharedVerb() {}
+            virtual void destroy( Pool *pool ) {
+                UTRACE( 8, "Verb::SharedVerb: destroy" );
+                Verb::destroy( pool );
+            }
+            virtual void operator() ( Context& context ) {
+                (*inner)( context );
+                if ( next ) (*next)( context );
+            }
+            virtual void depends( Dependencies& d ) {
+                inner->depends( d );
+                if ( next ) next->depends( d );
+            }
+        };
+
+        class Cache {
+            enum { PREDICATE, VERB };
+            struct Entry {
+                Entry *next;
+                uint64_t hash;
+                uint32_t kind;
+                uint32_t generation;
+                uint32_t length;
+                const void *binding;
+                char *source;
+                void *object;
+            };
+
+            Pool *pool;
+            Entry **bucket;
+            uint32_t buckets;       // power of two
+            uint32_t count;
+            uint32_t generation;
+
+            void grow() {
+                uint32_t size = buckets * 2;
+                Entry **grown = (Entry **)calloc( size, sizeof(Entry *) );
+                for ( uint32_t i = 0 ; i < buckets ; i++ ) {
+                    for ( Entry *e = bucket[i] ; e ; ) {
+                        Entry *next = e->next;
+                        uint32_t j = (uint32_t)e->hash & (size - 1);
+                        e->next = grown[j];
+                        grown[j] = e;
+                        e = next;
+                    }
+                }
+                free( bucket );
+                bucket = grown;
+                buckets = size;
+            }
+
+            Entry *find( uint32_t kind, const void *binding, uint64_t h,
+                         const char *source, uint32_t length ) {
+                for ( Entry *e = bucket[(uint32_t)h & (buckets - 1)] ; e ; e = e->next ) {
+                    if ( e->hash != h || e->kind != kind || e->length != length ) continue;
+                    if ( e->binding != binding ) continue;
+                    if ( memcmp(e->source, source, length) == 0 ) return e;
+                }
+                return 0;
+            }
+            void insert( uint32_t kind, const void *binding, uint64_t h,
+                         const char *source, uint32_t length, void *object ) {
+                if ( count >= buckets ) grow();
+                Entry *e = (Entry *)malloc( sizeof(Entry) );
+                e->hash = h;
+                e->binding = binding;
+                e->kind = kind;
+                e->generation = generation;
+                e->length = length;
+                e->source = (char *)malloc( length ? length : 1 );
+                memcpy( e->source, source, length );
+                e->object = object;
+                uint32_t i = (uint32_t)h & (buckets - 1);
+                e->next = bucket[i];
+                bucket[i] = e;
+                count++;
+            }
+            void release( Entry *e ) {
+                if ( e->kind == PREDICATE ) ((Predicate *)e->object)->destroy( pool );
+                else                        ((Verb *)e->object)->destroy( pool );
+                free( e->source );
+                free( e );
+            }
+        public:
+            uint32_t reused;        // this generation
+            uint32_t built;
+
+            Cache( Pool *pool )
+            : pool(pool), buckets(1024), count(0), generation(0), reused(0), built(0) {
+                bucket = (Entry **)calloc( buckets, sizeof(Entry *) );
+            }
+            ~Cache() {
+                for ( uint32_t i = 0 ; i < buckets ; i++ ) {
+                    for ( Entry *e = bucket[i] ; e ; ) {
+                        Entry *next = e->next;
+                        release( e );
+                        e = next;
+                    }
+                }
+                free( bucket );
+            }
+
+            void begin() {
+                generation++;
+                reused = built = 0;
+            }
+
+            Predicate *predicate( Pool *into, const void *binding, const char *source,
+                                  uint32_t length, Builder<Predicate>& build ) {
+                uint64_t h = hash( source, length );
+                Entry *e = find( PREDICATE, binding, h, source, length );
+                Predicate *object;
+                if ( e ) {
+                    e->generation = generation;
+                    object = (Predicate *)e->object;
+                    reused++;
+                } else {
+                    object = build( pool );
+                    if ( object == 0 ) return 0;
+                    insert( PREDICATE, binding, h, source, length, object );
+                    built++;
+                }
+                return new (into) SharedPredicate( object );
+            }
+            Predicate *predicate( Pool *into, const void *binding, Tcl_Obj *source,
+                                  Builder<Predicate>& build ) {
+                int length;
+                const char *s = Tcl_GetStringFromObj( source, &length );
+                return predicate( into, binding, s, length, build );
+            }
+
+            /*
+             * build makes the Verb alone, with a NULL next; next is the
+             * rest of the chain this use of it belongs to.
+             */
+            Verb *verb( Pool *into, const void *binding, const char *source, uint32_t length,
+                        Builder<Verb>& build, Verb *next ) {
+                uint64_t h = hash( source, length );
+                Entry *e = find( VERB, binding, h, source, length );
+                Verb *object;
+                if ( e ) {
+                    e->generation = generation;
+                    object = (Verb *)e->object;
+                    reused++;
+                } else {
+                    object = build( pool );
+                    if ( object == 0 ) return 0;
+                    insert( VERB, binding, h, source, length, object );
+                    built++;
+                }
+                return new (into) SharedVerb( object, next );
+            }
+            Verb *verb( Pool *into, const void *binding, Tcl_Obj *source,
+                        Builder<Verb>& build, Verb *next ) {
+                int length;
+                const char *s = Tcl_GetStringFromObj( source, &length );
+                return verb( into, binding, s, length, build, next );
+            }
+
+            /*
+             * Destroy every subtree the current generation did not use.
+             * Call once the previous Program is no longer evaluated.
+             */
+            uint32_t sweep() {
+                uint32_t released = 0;
+                for ( uint32_t i = 0 ; i < buckets ; i++ ) {
+                    Entry **link = &bucket[i];
+                    while ( *link ) {
+                        Entry *e = *link;
+                        if ( e->generation == generation ) {
+                            link = &e->next;
+                            continue;
+                        }
+                        *link = e->next;
+                        release( e );
+                        count--;
+                        released++;
+                    }
+                }
+                UTRACE2( 3, "Reload::Cache: reused, built", reused, built );
+                return released;
+            }
+
+            uint32_t size() const { return count; }
+        };
+    }
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
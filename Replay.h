@@ -0,0 +1,373 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_REPLAY_H_
+#define _OBJECT_REPLAY_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <algorithm>
+#include "tcl.h"
+#include "Numeric.h"
+
+/*
+ * End to end replay of captured HTTP headers through a RequestProgram
+ * and ResponseProgram.
+ *
+ * A capture file is a sequence of raw header blocks, each ended by an
+ * empty line.  A block starting with "HTTP/" is a response and is paired
+ * with the request before it.  Every thread gets its own programs, Field
+ * table and stand-in Context from a Loader, fills the bound Fields from
+ * each captured message and runs the programs over the whole capture.
+ *
+ * Pseudo headers bind the start line: ":method", ":uri" and ":version"
+ * for requests, ":version" and ":status" for responses.
+ */
+
+namespace Service {
+    namespace Replay {
+
+        struct Header {
+            const char *name;
+            uint32_t nameLength;
+            char *value;
+            uint32_t valueLength;
+        };
+
+        struct Message {
+            Header *headers;
+            uint32_t count;
+        };
+
+        struct Exchange {
+            Message request;
+            Message response;
+        };
+
+        /*
+         * Allocations made by the calling thread.  The replay driver
+         * interposes malloc() and bumps this; without it the count stays
+         * at zero.
+         */
+        inline uint64_t &allocations() {
+            static __thread uint64_t count = 0;
+            return count;
+        }
+
+        class Capture {
+            char *buffer;
+            uint32_t size;
+        public:
+            Exchange *exchanges;
+            uint32_t count;
+
+            Capture() : buffer(0), size(0), exchanges(0), count(0) { }
+            ~Capture() {
+                for ( uint32_t i = 0 ; i < count ; i++ ) {
+                    free( exchanges[i].request.headers );
+                    free( exchanges[i].response.headers );
+                }
+                free( exchanges );
+                free( buffer );
+            }
+
+        private:
+            static char *line( char *s, char *end, uint32_t *length ) {
+                char *eol = (char *)memchr( s, '\n', end - s );
+                if ( eol == 0 ) eol = end;
+                *length = eol - s;
+                if ( *length > 0 && s[*length - 1] == '\r' ) (*length)--;
+                return ( eol < end ) ? eol + 1 : end;
+            }
+            static void add( Message *m, uint32_t *capacity, const char *name,
+                             uint32_t nameLength, char *value, uint32_t valueLength ) {
+                if ( m->count == *capacity ) {
+                    *capacity = *capacity ? *capacity * 2 : 16;
+                    m->headers = (Header *)realloc( m->headers, *capacity * sizeof(Header) );
+                }
+                Header *h = &m->headers[m->count++];
+                h->name = name;
+                h->nameLength = nameLength;
+                h->value = value;
+                h->valueLength = valueLength;
+            }
+            /*
+             * Split the start line into its pseudo headers.
+             */
+            static void start( Message *m, uint32_t *capacity, char *s, uint32_t length, bool response ) {
+                static const char *request[] = { ":method", ":uri", ":version" };
+                static const char *status[]  = { ":version", ":status" };
+                const char **names = response ? status : request;
+                uint32_t parts = response ? 2 : 3;
+                char *end = s + length;
+                for ( uint32_t i = 0 ; i < parts && s < end ; i++ ) {
+                    char *sp = ( i + 1 < parts ) ? (char *)memchr( s, ' ', end - s ) : 0;
+                    if ( sp == 0 ) sp = end;
+                    add( m, capacity, names[i], strlen(names[i]), s, sp - s );
+                    s = ( sp < end ) ? sp + 1 : end;
+                }
+            }
+
+        public:
+            bool load( const char *path ) {
+                FILE *f = fopen( path, "rb" );
+                if ( f == NULL ) return false;
+                long bytes = -1;
+                if ( fseek(f, 0, SEEK_END) == 0 ) bytes = ftell( f );
+                if ( bytes < 0 || bytes >= 0xffffffffL || fseek(f, 0, SEEK_SET) != 0 ) {
+                    fclose( f );
+                    return false;
+                }
+                size = bytes;
+                buffer = (char *)malloc( size + 1 );
+                if ( buffer == 0 || fread(buffer, 1, size, f) != size ) {
+                    fclose( f );
+                    return false;
+                }
+                fclose( f );
+
+                uint32_t capacity = 0;
+                char *s = buffer, *end = buffer + size;
+                while ( s < end ) {
+                    uint32_t length;
+                    char *next = line( s, end, &length );
+                    if ( length == 0 ) { s = next; continue; }
+
+                    bool response = ( length > 5 && strncmp(s, "HTTP/", 5) == 0 );
+                    if ( response == false || count == 0 || exchanges[count-1].response.count > 0 ) {
+                        if ( count == capacity ) {
+                            capacity = capacity ? capacity * 2 : 256;
+                            exchanges = (Exchange *)realloc( exchanges, capacity * sizeof(Exchange) );
+                        }
+                        memset( &exchanges[count++], 0, sizeof(Exchange) );
+                    }
+                    Message *m = response ? &exchanges[count-1].response : &exchanges[count-1].request;
+                    uint32_t headers = 0;
+                    start( m, &headers, s, length, response );
+
+                    for ( s = next ; s < end ; s = next ) {
+                        next = line( s, end, &length );
+                        if ( length == 0 ) { s = next; break; }
+                        char *colon = (char *)memchr( s, ':', length );
+                        if ( colon == 0 ) continue;
+                        char *value = colon + 1, *eov = s + length;
+                        while ( value < eov && (*value == ' ' || *value == '\t') ) value++;
+                        add( m, &headers, s, colon - s, value, eov - value );
+                    }
+                }
+                return count > 0;
+            }
+        };
+
+        /*
+         * Maps header names onto the Fields the policy was built with.
+         */
+        class Binding {
+            struct Slot {
+                const char *name;
+                Field *field;
+            };
+            Slot *slots;
+            uint32_t count;
+            uint32_t capacity;
+        public:
+            Binding() : slots(0), count(0), capacity(0) { }
+            ~Binding() { free( slots ); }
+            void bind( const char *name, Field *field ) {
+                if ( count == capacity ) {
+                    capacity = capacity ? capacity * 2 : 32;
+                    slots = (Slot *)realloc( slots, capacity * sizeof(Slot) );
+                }
+                slots[count].name = name;
+                slots[count].field = field;
+                count++;
+            }
+            Field *lookup( const char *name, uint32_t length ) {
+                for ( uint32_t i = 0 ; i < count ; i++ ) {
+                    if ( strncasecmp(slots[i].name, name, length) == 0 && slots[i].name[length] == '\0' ) {
+                        return slots[i].field;
+                    }
+                }
+                return 0;
+            }
+            void clear() {
+                for ( uint32_t i = 0 ; i < count ; i++ ) ClearFields( 1, slots[i].field );
+            }
+            /*
+             * Fill the bound Fields from one message.  Repeated headers
+             * bump count and keep the first value, numeric values are
+             * decoded into Field::value.
+             */
+            void fill( Message& m ) {
+                clear();
+                for ( uint32_t i = 0 ; i < m.count ; i++ ) {
+                    Header& h = m.headers[i];
+                    Field *f = lookup( h.name, h.nameLength );
+                    if ( f == 0 ) continue;
+                    if ( f->count++ > 0 ) continue;
+                    f->start = h.value;
+                    f->length = h.valueLength;
+                    f->end = h.value + h.valueLength;
+                    uint64_t value = 0;
+                    Numeric::decimal( h.value, h.valueLength, &value );
+                    f->value = Numeric::saturate( value );
+                }
+            }
+        };
+
+        /*
+         * Supplies each replay thread with its own programs, bindings and
+         * Context.  Programs keep raw Field pointers, so they cannot be
+         * shared between threads.
+         */
+        class Loader {
+        public:
+            virtual ~Loader() {}
+            virtual bool operator () ( Binding& request, Binding& response,
+                                       RequestProgram **, ResponseProgram **,
+                                       Context ** ) = 0;
+        };
+
+        struct Result {
+            uint64_t exchanges;
+            uint64_t elapsed;
+            uint64_t allocations;
+            uint64_t p50, p99, p999;
+        };
+
+        class Runner {
+            Capture& capture;
+            Loader& loader;
+            uint32_t passes;
+
+            struct Thread {
+                Runner *runner;
+                pthread_t thread;
+                uint64_t *latency;
+                uint64_t samples;
+                uint64_t allocations;
+                bool ok;
+            };
+
+            static uint64_t now() {
+                struct timespec ts;
+                clock_gettime( CLOCK_MONOTONIC, &ts );
+                return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            }
+
+            static void *replay( void *arg ) {
+                Thread *t = (Thread *)arg;
+                Runner *r = t->runner;
+                Binding request, response;
+                RequestProgram *rq = 0;
+                ResponseProgram *rs = 0;
+                Context *context = 0;
+
+                t->ok = r->loader( request, response, &rq, &rs, &context );
+                if ( t->ok == false ) return 0;
+
+                uint64_t before = allocations();
+                for ( uint32_t pass = 0 ; pass < r->passes ; pass++ ) {
+                    for ( uint32_t i = 0 ; i < r->capture.count ; i++ ) {
+                        Exchange& x = r->capture.exchanges[i];
+                        uint64_t begin = now();
+                        request.fill( x.request );
+                        (*rq)( context );
+                        if ( x.response.count > 0 ) {
+                            response.fill( x.response );
+                            (*rs)( context );
+                        }
+                        t->latency[t->samples++] = now() - begin;
+                    }
+                }
+                t->allocations = allocations() - before;
+                return 0;
+            }
+
+            static uint64_t percentile( uint64_t *sorted, uint64_t n, double p ) {
+                if ( n == 0 ) return 0;
+                uint64_t i = (uint64_t)( p * (n - 1) );
+                return sorted[i];
+            }
+
+        public:
+            Runner( Capture& capture, Loader& loader, uint32_t passes )
+            : capture(capture), loader(loader), passes(passes ? passes : 1) { }
+
+            bool run( uint32_t threads, Result *result ) {
+                if ( threads == 0 ) threads = 1;
+                uint64_t per = (uint64_t)capture.count * passes;
+                Thread *t = new Thread[threads];
+                uint64_t *latency = (uint64_t *)malloc( per * threads * sizeof(uint64_t) );
+                bool ok = ( latency != 0 );
+
+                uint64_t begin = now();
+                uint32_t started = 0;
+                while ( ok && started < threads ) {
+                    t[started].runner = this;
+                    t[started].latency = latency + per * started;
+                    t[started].samples = 0;
+                    t[started].allocations = 0;
+                    t[started].ok = false;
+                    if ( pthread_create(&t[started].thread, NULL, replay, &t[started]) != 0 ) {
+                        ok = false;
+                        break;
+                    }
+                    started++;
+                }
+                for ( uint32_t i = 0 ; i < started ; i++ ) {
+                    pthread_join( t[i].thread, NULL );
+                    if ( t[i].ok == false ) ok = false;
+                }
+                result->elapsed = now() - begin;
+
+                result->exchanges = 0;
+                result->allocations = 0;
+                for ( uint32_t i = 0 ; i < started ; i++ ) {
+                    // compact the samples so the sort covers only real ones
+                    if ( t[i].latency != latency + result->exchanges ) {
+                        memmove( latency + result->exchanges, t[i].latency, t[i].samples * sizeof(uint64_t) );
+                    }
+                    result->exchanges += t[i].samples;
+                    result->allocations += t[i].allocations;
+                }
+                if ( latency ) std::sort( latency, latency + result->exchanges );
+                result->p50  = percentile( latency, result->exchanges, 0.50 );
+                result->p99  = percentile( latency, result->exchanges, 0.99 );
+                result->p999 = percentile( latency, result->exchanges, 0.999 );
+
+                free( latency );
+                delete [] t;
+                return ok;
+            }
+        };
+    }
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,267 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_REPLICA_H_
+#define _OBJECT_REPLICA_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstdio>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "tcl.h"
+
+/*
+ * Per thread replicas of a frozen Program.
+ *
+ * A Program and everything hanging off it -- Predicates, Globs, the
+ * String literals -- is allocated from a Pool when the policy is built.
+ * The tree itself is read only afterwards, but the Program also carries
+ * per-message state (contentLength, the bound Field values, decode
+ * results), so it cannot be shared between threads.  Replicas gives
+ * every worker thread its own copy, built on that thread the first time
+ * it calls local().  A thread that has called bind() runs on one NUMA
+ * node, so the first touch of every Pool page of its replica happens on
+ * the node that will read it.
+ *
+ * One replica per node would use less memory, but the threads of a node
+ * would then have to serialize on its per-message state, which costs
+ * more than the remote reads it saves.  Memory therefore grows with the
+ * number of worker threads; it is bounded by the limit given to the
+ * constructor, by default the number of configured CPUs, which is the
+ * most workers that can usefully run at once.  A thread past the limit
+ * gets no replica.
+ *
+ * Each thread remembers its replicas of the last SLOTS Replicas it used,
+ * so a worker that runs both a request and a response Program finds
+ * both with a thread local scan.  Only the first call, or a call after
+ * more than SLOTS other Replicas were used, takes the registry lock.
+ */
+
+namespace Service {
+
+    class Replicas {
+    public:
+        /*
+         * Builds one complete Program.  Called once per thread, on that
+         * thread, possibly concurrently with other threads, and must
+         * allocate everything it builds from a Pool created inside the
+         * call.  node is the node the thread is bound to, or -1.
+         */
+        class Builder {
+        public:
+            virtual ~Builder() {}
+            virtual Program *operator () ( int32_t node ) = 0;
+        };
+
+        static const uint32_t MAXNODES = 64;
+        static const uint32_t SLOTS = 4;        // Replicas remembered per thread
+    private:
+        struct Replica {
+            pthread_t thread;
+            Program *program;
+        };
+        struct Local {
+            int32_t node;
+            uint32_t next;                      // slot to replace next
+            struct {
+                Replicas *owner;
+                Program *program;
+            } slot[SLOTS];
+        };
+
+        Builder &builder;
+        uint32_t nodes;
+        bool present[MAXNODES];
+        cpu_set_t cpus[MAXNODES];
+        pthread_mutex_t lock;
+        Replica *replica;
+        uint32_t replicas;
+        uint32_t pending;                       // being built, registry space reserved
+        uint32_t capacity;
+        uint32_t limit;
+
+        static Local &threadLocal() {
+            static __thread Local local = { -1, 0, { { 0, 0 } } };
+            return local;
+        }
+
+        /*
+         * Parse a sysfs cpulist ("0-7,16-23") into a cpu_set_t.  The
+         * node list in node/online has the same format.
+         */
+        static bool parse( const char *path, cpu_set_t *set ) {
+            FILE *f = fopen( path, "r" );
+            if ( f == NULL ) return false;
+            CPU_ZERO( set );
+            unsigned int low, high;
+            int c;
+            while ( fscanf(f, "%u", &low) == 1 ) {
+                high = low;
+                c = fgetc( f );
+                if ( c == '-' ) {
+                    if ( fscanf(f, "%u", &high) != 1 ) break;
+                    c = fgetc( f );
+                }
+                for ( unsigned int cpu = low ; cpu <= high && cpu < CPU_SETSIZE ; cpu++ ) {
+                    CPU_SET( cpu, set );
+                }
+                if ( c != ',' ) break;
+            }
+            fclose( f );
+            return true;
+        }
+
+        /*
+         * The calling thread's replica, building and registering it if
+         * this thread has none yet.  Registry space is reserved before
+         * the build, so every replica built is listed and a thread never
+         * builds a second one.
+         */
+        Program *replicate( int32_t node ) {
+            pthread_t self = pthread_self();
+            pthread_mutex_lock( &lock );
+            for ( uint32_t i = 0 ; i < replicas ; i++ ) {
+                if ( pthread_equal(replica[i].thread, self) ) {
+                    Program *p = replica[i].program;
+                    pthread_mutex_unlock( &lock );
+                    return p;
+                }
+            }
+            if ( replicas + pending >= limit ) {
+                pthread_mutex_unlock( &lock );
+                UINFO( 1, "Replicas: limit of " << limit << " replicas reached" << endl );
+                return 0;
+            }
+            if ( replicas + pending == capacity ) {
+                uint32_t size = capacity ? capacity * 2 : 16;
+                Replica *grown = (Replica *)realloc( replica, size * sizeof(Replica) );
+                if ( grown == 0 ) {
+                    pthread_mutex_unlock( &lock );
+                    UINFO( 1, "Replicas: cannot grow the registry" << endl );
+                    return 0;
+                }
+                replica = grown;
+                capacity = size;
+            }
+            pending++;
+            pthread_mutex_unlock( &lock );
+
+            Program *p = builder( node );
+
+            pthread_mutex_lock( &lock );
+            pending--;
+            if ( p ) {
+                replica[replicas].thread = self;
+                replica[replicas].program = p;
+                replicas++;
+            }
+            pthread_mutex_unlock( &lock );
+            if ( p == 0 ) {
+                UINFO( 1, "Replicas: builder failed for node " << node << endl );
+            }
+            return p;
+        }
+
+    public:
+        /*
+         * limit caps the number of replicas; zero means one per
+         * configured CPU.
+         */
+        Replicas( Builder& builder, uint32_t limit = 0 )
+        : builder(builder), nodes(0), replica(0), replicas(0), pending(0),
+          capacity(0), limit(limit) {
+            if ( this->limit == 0 ) {
+                long cpus = sysconf( _SC_NPROCESSORS_CONF );
+                this->limit = ( cpus > 0 ) ? (uint32_t)cpus : 1;
+            }
+            pthread_mutex_init( &lock, NULL );
+            for ( uint32_t node = 0 ; node < MAXNODES ; node++ ) present[node] = false;
+            cpu_set_t online;
+            if ( parse("/sys/devices/system/node/online", &online) ) {
+                for ( uint32_t node = 0 ; node < MAXNODES ; node++ ) {
+                    if ( CPU_ISSET(node, &online) == 0 ) continue;
+                    char path[64];
+                    snprintf( path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node );
+                    if ( parse(path, &cpus[node]) == false ) continue;
+                    present[node] = true;
+                    nodes++;
+                }
+            }
+            if ( nodes == 0 ) {
+                // no NUMA topology exported, treat the box as one node
+                sched_getaffinity( 0, sizeof(cpu_set_t), &cpus[0] );
+                present[0] = true;
+                nodes = 1;
+            }
+        }
+        ~Replicas() {
+            pthread_mutex_destroy( &lock );
+            if ( replica ) free( replica );
+        }
+
+        uint32_t count() const { return nodes; }
+        bool online( uint32_t node ) const { return node < MAXNODES && present[node]; }
+
+        /*
+         * The replicas built so far, in the order threads asked for them.
+         */
+        uint32_t size() const { return replicas; }
+        Program *operator [] ( uint32_t i ) { return replica[i].program; }
+
+        /*
+         * Pin the calling thread to the CPUs of a node.  Call before the
+         * first local() so the replica is built on that node.
+         */
+        bool bind( uint32_t node ) {
+            if ( online(node) == false ) return false;
+            threadLocal().node = node;
+            return sched_setaffinity( 0, sizeof(cpu_set_t), &cpus[node] ) == 0;
+        }
+
+        /*
+         * The calling thread's own replica.  Returns NULL if the Builder
+         * failed, the registry could not grow or the limit was reached;
+         * the next call tries again.
+         */
+        Program *local() {
+            Local &local = threadLocal();
+            for ( uint32_t i = 0 ; i < SLOTS ; i++ ) {
+                if ( local.slot[i].owner == this ) return local.slot[i].program;
+            }
+            Program *p = replicate( local.node );
+            if ( p ) {
+                uint32_t i = local.next;
+                local.next = (i + 1) % SLOTS;
+                local.slot[i].owner = this;
+                local.slot[i].program = p;
+            }
+            return p;
+        }
+    };
+
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
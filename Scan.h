@@ -0,0 +1,159 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_SCAN_H_
+#define _OBJECT_SCAN_H_
+
+#include <stdint.h>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Byte scanners for framing and header splitting.
+ *
+ * find() returns the first occurrence of a byte in [s, end) or end.  It
+ * compares sixteen bytes per step with SSE2 where available and eight
+ * per step with SWAR arithmetic otherwise.  search() is a memmem built
+ * on it, optionally ignoring ASCII case.
+ */
+
+namespace Service {
+    namespace Scan {
+
+        inline uint64_t broadcast( char c ) {
+            return 0x0101010101010101ULL * (uint8_t)c;
+        }
+
+        /*
+         * Non-zero in the high bit of every byte of x that is zero.  Bytes
+         * more significant than the lowest zero byte may be false positives,
+         * which is fine since only the lowest one is used.
+         */
+        inline uint64_t zeroes( uint64_t x ) {
+            return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+        }
+
+        inline const char *find( const char *s, const char *end, char c ) {
+        #ifdef __SSE2__
+            __m128i needle = _mm_set1_epi8( c );
+            while ( end - s >= 16 ) {
+                __m128i block = _mm_loadu_si128( (const __m128i *)s );
+                int mask = _mm_movemask_epi8( _mm_cmpeq_epi8(block, needle) );
+                if ( mask ) return s + __builtin_ctz( mask );
+                s += 16;
+            }
+        #endif
+            uint64_t pattern = broadcast( c );
+            while ( end - s >= 8 ) {
+                uint64_t x;
+                memcpy( &x, s, sizeof(x) );
+            #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                // first byte in memory must be the least significant
+                x = __builtin_bswap64( x );
+            #endif
+                uint64_t hit = zeroes( x ^ pattern );
+                if ( hit ) return s + (__builtin_ctzll( hit ) >> 3);
+                s += 8;
+            }
+            while ( s < end && *s != c ) s++;
+            return s;
+        }
+
+        inline char *find( char *s, char *end, char c ) {
+            return (char *)find( (const char *)s, (const char *)end, c );
+        }
+
+        inline char fold( char c ) {
+            return ( c >= 'A' && c <= 'Z' ) ? c + ('a' - 'A') : c;
+        }
+
+        /*
+         * find() for either of two bytes, used to find a letter in
+         * either case.
+         */
+        inline const char *either( const char *s, const char *end, char a, char b ) {
+        #ifdef __SSE2__
+            __m128i x = _mm_set1_epi8( a );
+            __m128i y = _mm_set1_epi8( b );
+            while ( end - s >= 16 ) {
+                __m128i block = _mm_loadu_si128( (const __m128i *)s );
+                __m128i hit = _mm_or_si128( _mm_cmpeq_epi8(block, x), _mm_cmpeq_epi8(block, y) );
+                int mask = _mm_movemask_epi8( hit );
+                if ( mask ) return s + __builtin_ctz( mask );
+                s += 16;
+            }
+        #endif
+            uint64_t px = broadcast( a ), py = broadcast( b );
+            while ( end - s >= 8 ) {
+                uint64_t w;
+                memcpy( &w, s, sizeof(w) );
+            #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                w = __builtin_bswap64( w );
+            #endif
+                // the lowest flagged byte of each term is a real match
+                uint64_t hit = zeroes( w ^ px ) | zeroes( w ^ py );
+                if ( hit ) return s + (__builtin_ctzll( hit ) >> 3);
+                s += 8;
+            }
+            while ( s < end && *s != a && *s != b ) s++;
+            return s;
+        }
+
+        /*
+         * True if the length bytes at s equal needle, which is already
+         * folded when caseless is set.
+         */
+        inline bool same( const char *s, const char *needle, uint32_t length, bool caseless ) {
+            if ( caseless == false ) return memcmp( s, needle, length ) == 0;
+            for ( uint32_t i = 0 ; i < length ; i++ ) {
+                if ( fold(s[i]) != needle[i] ) return false;
+            }
+            return true;
+        }
+
+        /*
+         * First occurrence of needle in [s, end), or 0.  Candidates are
+         * found with find()/either() on the first byte of the needle.
+         */
+        inline const char *search( const char *s, const char *end,
+                                   const char *needle, uint32_t length, bool caseless ) {
+            if ( length == 0 ) return s;
+            char first = needle[0];
+            char other = first;
+            if ( caseless && first >= 'a' && first <= 'z' ) other = first - ('a' - 'A');
+            while ( end - s >= (long)length ) {
+                const char *last = end - length + 1;
+                s = ( first == other ) ? find( s, last, first ) : either( s, last, first, other );
+                if ( s == last ) return 0;
+                if ( same(s + 1, needle + 1, length - 1, caseless) ) return s;
+                s++;
+            }
+            return 0;
+        }
+    }
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
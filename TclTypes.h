@@ -0,0 +1,311 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_TCLTYPES_H_
+#define _OBJECT_TCLTYPES_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include "tcl.h"
+
+/*
+ * Compiled policy objects cached in Tcl_Obj internal representations.
+ *
+ * A policy script hands the same literal Tcl_Obj to Initialize() every
+ * time it is evaluated, and Tcl shares literals across every rule that
+ * spells them the same way.  Hanging the compiled form off the object
+ * lets repeated rules and repeated loads skip the parse and compile:
+ *
+ *     service-glob         a Glob automaton plus its GlobFilter
+ *     service-atom         an interned Atom (ptr2 is the AtomTable)
+ *     service-prefix       a parsed "a.b.c.d/bits" address prefix
+ *
+ * Only objects that do not depend on a Program's Fields are cached here;
+ * the same literal may be used by several Programs, each with its own
+ * Field table.  Whole rule subtrees are reused through Reload::Cache,
+ * which keys them on their Field binding.
+ *
+ * A Glob is a reference counted Native object: the Tcl_Obj holds one
+ * reference and every GlobMatches handed out holds another, so the
+ * automaton is destroyed, into the Pool it was built in, only when Tcl
+ * has let go of the literal and the last Program using it has been
+ * destroyed.  That Pool must outlive both.  The string rep is never
+ * invalidated, so none of the types need an update or setFromAny proc;
+ * a shimmer to another type simply releases the cached object.
+ *
+ * Intreps are read and written on the interpreter thread only.  The
+ * reference counts are atomic so a Program may be destroyed elsewhere;
+ * a Native released on another thread is queued, and destroyed into its
+ * Pool by the interpreter thread the next time it calls into here (or
+ * calls Reap()).
+ */
+
+namespace Service {
+    namespace TclTypes {
+
+        class Native {
+            volatile uint32_t references;
+            Native *deferred;
+
+            struct Thread {
+                pthread_t thread;
+                bool known;
+            };
+            static Thread& interpreter() {
+                static Thread t = { pthread_t(), false };
+                return t;
+            }
+            static Native *volatile& queue() {
+                static Native *volatile head = 0;
+                return head;
+            }
+        protected:
+            Pool *owner;
+            virtual void dispose() = 0;
+        public:
+            Native( Pool *owner ) : references(1), deferred(0), owner(owner) { }
+            virtual ~Native() {}
+            void retain() { __sync_fetch_and_add( &references, 1 ); }
+            void release() {
+                if ( __sync_sub_and_fetch(&references, 1) != 0 ) return;
+                if ( onInterpreter() ) {
+                    dispose();
+                    delete this;
+                    return;
+                }
+                Native *head;
+                do {
+                    head = queue();
+                    deferred = head;
+                } while ( __sync_bool_compare_and_swap(&queue(), head, this) == false );
+            }
+
+            /*
+             * Called on the interpreter thread.  Until then every release
+             * is deferred.
+             */
+            static void adopt() {
+                interpreter().thread = pthread_self();
+                interpreter().known = true;
+            }
+            static bool onInterpreter() {
+                return interpreter().known && pthread_equal( interpreter().thread, pthread_self() );
+            }
+
+            /*
+             * Destroy everything released on other threads.  Interpreter
+             * thread only.
+             */
+            static uint32_t reap() {
+                Native *native = __sync_lock_test_and_set( &queue(), (Native *)0 );
+                uint32_t n = 0;
+                while ( native ) {
+                    Native *next = native->deferred;
+                    native->dispose();
+                    delete native;
+                    native = next;
+                    n++;
+                }
+                return n;
+            }
+        };
+
+        class NativeGlob : public Native {
+        public:
+            Glob *glob;
+            GlobFilter filter;
+            NativeGlob( Pool *owner, const char *pattern, bool caseless )
+            : Native(owner),
+              glob( GlobMatches::compile(owner, pattern, caseless) ),
+              filter( pattern, caseless ) { }
+            virtual ~NativeGlob() {}
+        protected:
+            virtual void dispose() { glob->destroy( owner ); }
+        };
+
+        inline void freeNative( Tcl_Obj *obj ) {
+            ((Native *)obj->internalRep.twoPtrValue.ptr1)->release();
+        }
+        inline void dupNative( Tcl_Obj *src, Tcl_Obj *dup ) {
+            ((Native *)src->internalRep.twoPtrValue.ptr1)->retain();
+            dup->internalRep = src->internalRep;
+            dup->typePtr = src->typePtr;
+        }
+        inline void dupPlain( Tcl_Obj *src, Tcl_Obj *dup ) {
+            dup->internalRep = src->internalRep;
+            dup->typePtr = src->typePtr;
+        }
+
+        inline const Tcl_ObjType *globType() {
+            static const Tcl_ObjType type = { "service-glob", freeNative, dupNative, NULL, NULL };
+            return &type;
+        }
+        inline const Tcl_ObjType *atomType() {
+            static const Tcl_ObjType type = { "service-atom", NULL, dupPlain, NULL, NULL };
+            return &type;
+        }
+        inline const Tcl_ObjType *prefixType() {
+            static const Tcl_ObjType type = { "service-prefix", NULL, dupPlain, NULL, NULL };
+            return &type;
+        }
+
+        /*
+         * Replace whatever intrep obj has.  The string rep is generated
+         * first since the new type cannot regenerate it.
+         */
+        inline void set( Tcl_Obj *obj, const Tcl_ObjType *type, void *ptr1, void *ptr2 ) {
+            Tcl_GetString( obj );
+            if ( obj->typePtr && obj->typePtr->freeIntRepProc ) {
+                obj->typePtr->freeIntRepProc( obj );
+            }
+            obj->internalRep.twoPtrValue.ptr1 = ptr1;
+            obj->internalRep.twoPtrValue.ptr2 = ptr2;
+            obj->typePtr = type;
+        }
+
+        /*
+         * A GlobMatches borrowing the cached automaton; holds a reference
+         * for as long as the predicate lives.
+         */
+        class NativeGlobMatches : public GlobMatches {
+            NativeGlob *native;
+        public:
+            NativeGlobMatches( StringCoercion *coercion, NativeGlob *native, bool caseless )
+            : GlobMatches(coercion, native->glob, native->filter, caseless), native(native) {
+                native->retain();
+            }
+            virtual ~NativeGlobMatches() {}
+            virtual void destroy( Pool *pool ) {
+                UTRACE( 8, "Predicate::NativeGlobMatches: destroy" );
+                NativeGlob *held = native;
+                GlobMatches::destroy( pool );
+                held->release();
+            }
+        };
+
+        /*
+         * Glob match on the pattern in obj, compiling into owner the
+         * first time obj is seen with these flags.  The predicate itself
+         * and the coercion are allocated from into.
+         */
+        inline Predicate *
+        GetGlobMatches( Pool *into, Pool *owner, StringCoercion *coercion,
+                        Tcl_Obj *pattern, uint32_t flags = 0 ) {
+            Native::reap();
+            bool caseless = (flags & GlobMatches::CASELESS) != 0;
+            NativeGlob *native;
+            if ( pattern->typePtr == globType() &&
+                 (uintptr_t)pattern->internalRep.twoPtrValue.ptr2 == flags ) {
+                native = (NativeGlob *)pattern->internalRep.twoPtrValue.ptr1;
+            } else {
+                native = new NativeGlob( owner, Tcl_GetString(pattern), caseless );
+                set( pattern, globType(), native, (void *)(uintptr_t)flags );
+            }
+            return new (into) NativeGlobMatches( coercion, native, caseless );
+        }
+
+        /*
+         * The Atom for obj in table.  An Atom cached for another table
+         * is interned again.
+         */
+        inline Atom *GetAtom( Tcl_Obj *obj, AtomTable *table ) {
+            if ( obj->typePtr == atomType() && obj->internalRep.twoPtrValue.ptr2 == table ) {
+                return (Atom *)obj->internalRep.twoPtrValue.ptr1;
+            }
+            int length;
+            const char *s = Tcl_GetStringFromObj( obj, &length );
+            Atom *atom = table->intern( s, length );
+            set( obj, atomType(), atom, table );
+            return atom;
+        }
+
+        /*
+         * Parse "a.b.c.d" or "a.b.c.d/bits".  Returns false, leaving obj
+         * alone, if it is not a valid prefix.
+         */
+        inline bool GetPrefix( Tcl_Obj *obj, uint32_t *addr, uint32_t *bits ) {
+            if ( obj->typePtr == prefixType() ) {
+                *addr = (uint32_t)(uintptr_t)obj->internalRep.twoPtrValue.ptr1;
+                *bits = (uint32_t)(uintptr_t)obj->internalRep.twoPtrValue.ptr2;
+                return true;
+            }
+            int length;
+            const char *s = Tcl_GetStringFromObj( obj, &length );
+            const char *end = s + length;
+            uint32_t a = 0, n = 32;
+            for ( int octet = 0 ; octet < 4 ; octet++ ) {
+                if ( octet > 0 ) {
+                    if ( s == end || *s != '.' ) return false;
+                    s++;
+                }
+                uint32_t value = 0, digits = 0;
+                while ( s < end && *s >= '0' && *s <= '9' && digits < 4 ) {
+                    value = value * 10 + (*s++ - '0');
+                    digits++;
+                }
+                if ( digits == 0 || digits > 3 || value > 255 ) return false;
+                a = (a << 8) | value;
+            }
+            if ( s < end && *s == '/' ) {
+                s++;
+                uint32_t digits = 0;
+                n = 0;
+                while ( s < end && *s >= '0' && *s <= '9' && digits < 3 ) {
+                    n = n * 10 + (*s++ - '0');
+                    digits++;
+                }
+                if ( digits == 0 || n == 0 || n > 32 ) return false;
+            }
+            if ( s != end ) return false;
+            set( obj, prefixType(), (void *)(uintptr_t)a, (void *)(uintptr_t)n );
+            *addr = a;
+            *bits = n;
+            return true;
+        }
+
+        inline Predicate *GetAddressMatches( Pool *into, Tcl_Obj *obj ) {
+            uint32_t addr, bits;
+            if ( GetPrefix(obj, &addr, &bits) == false ) return 0;
+            return new (into) AddressMatches( addr, bits );
+        }
+
+        /*
+         * Make the types visible to Tcl_GetObjType/Tcl_ConvertToType
+         * (for introspection only; there is no setFromAny).  Call once
+         * from the package init, on the interpreter thread.
+         */
+        inline void RegisterObjTypes() {
+            Tcl_RegisterObjType( globType() );
+            Tcl_RegisterObjType( atomType() );
+            Tcl_RegisterObjType( prefixType() );
+            Native::adopt();
+        }
+
+        inline uint32_t Reap() { return Native::reap(); }
+    }
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
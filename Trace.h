@@ -0,0 +1,163 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_TRACE_H_
+#define _OBJECT_TRACE_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Compile time gated tracing for hot paths.
+ *
+ * UTRACE( level, "message" ) and UTRACE2( level, "message", a, b ) are
+ * removed by the compiler when level is above UTRACE_CEILING.  Levels at
+ * or below the ceiling do no formatting and take no locks: the call
+ * stores the message pointer, two integers and a timestamp in a ring
+ * owned by the calling thread.  Trace::dump() formats the rings later,
+ * off the request path.  message must be a string literal.
+ */
+
+#ifndef UTRACE_CEILING
+#define UTRACE_CEILING 4
+#endif
+
+namespace Service {
+    namespace Trace {
+
+        template <int level>
+        struct Gate {
+            enum { open = (level <= UTRACE_CEILING) };
+        };
+
+        inline uint64_t ticks() {
+        #if defined(__x86_64__) || defined(__i386__)
+            uint32_t lo, hi;
+            __asm__ __volatile__ ( "rdtsc" : "=a"(lo), "=d"(hi) );
+            return ((uint64_t)hi << 32) | lo;
+        #elif defined(__powerpc__) || defined(__ppc__)
+            uint64_t tb;
+            __asm__ __volatile__ ( "mftb %0" : "=r"(tb) );
+            return tb;
+        #else
+            struct timespec ts;
+            clock_gettime( CLOCK_MONOTONIC, &ts );
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        #endif
+        }
+
+        struct Record {
+            uint64_t ticks;
+            const char *message;
+            uint64_t a;
+            uint64_t b;
+            uint32_t level;
+        };
+
+        static const uint32_t SIZE = 1024;      // records per thread, power of two
+
+        struct Ring {
+            Record records[SIZE];
+            volatile uint64_t head;
+            pthread_t thread;
+            Ring *next;
+        };
+
+        struct Rings {
+            pthread_mutex_t lock;
+            Ring *first;
+        };
+
+        inline Rings &rings() {
+            static Rings r = { PTHREAD_MUTEX_INITIALIZER, 0 };
+            return r;
+        }
+
+        inline Ring *ring() {
+            static __thread Ring *mine = 0;
+            if ( __builtin_expect(mine != 0, 1) ) return mine;
+            mine = (Ring *)calloc( 1, sizeof(Ring) );
+            if ( mine == 0 ) return 0;
+            mine->thread = pthread_self();
+            Rings& r = rings();
+            pthread_mutex_lock( &r.lock );
+            mine->next = r.first;
+            r.first = mine;
+            pthread_mutex_unlock( &r.lock );
+            return mine;
+        }
+
+        inline void record( uint32_t level, const char *message, uint64_t a, uint64_t b ) {
+            Ring *r = ring();
+            if ( r == 0 ) return;
+            Record& rec = r->records[r->head & (SIZE - 1)];
+            rec.ticks = ticks();
+            rec.message = message;
+            rec.a = a;
+            rec.b = b;
+            rec.level = level;
+            __sync_synchronize();
+            r->head++;
+        }
+
+        /*
+         * Format the retained records of every thread, oldest first.  A
+         * record being overwritten while it is printed may come out torn.
+         */
+        inline void dump( OStream& out ) {
+            Rings& r = rings();
+            pthread_mutex_lock( &r.lock );
+            for ( Ring *ring = r.first ; ring ; ring = ring->next ) {
+                uint64_t head = ring->head;
+                uint64_t first = ( head > SIZE ) ? head - SIZE : 0;
+                for ( uint64_t i = first ; i < head ; i++ ) {
+                    Record& rec = ring->records[i & (SIZE - 1)];
+                    out << (unsigned long)ring->thread << " " << rec.ticks
+                        << " " << rec.level << " " << rec.message
+                        << " " << rec.a << " " << rec.b << endl;
+                }
+            }
+            pthread_mutex_unlock( &r.lock );
+        }
+    }
+}
+
+#define UTRACE( level, message ) \
+    do { \
+        if ( Service::Trace::Gate<level>::open ) { \
+            Service::Trace::record( level, message, 0, 0 ); \
+        } \
+    } while (0)
+
+#define UTRACE2( level, message, a, b ) \
+    do { \
+        if ( Service::Trace::Gate<level>::open ) { \
+            Service::Trace::record( level, message, (uint64_t)(a), (uint64_t)(b) ); \
+        } \
+    } while (0)
+
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
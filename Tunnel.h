@@ -0,0 +1,432 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _OBJECT_TUNNEL_H_
+#define _OBJECT_TUNNEL_H_
+
+#include <stdint.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifdef HAVE_IO_URING
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "tcl.h"
+
+/*
+ * Zero copy data path for tunneled connections.
+ *
+ * Once the tunnel verb (or a ResponseProgram seeing Upgrade) has put a
+ * connection into pass-through, bytes are moved between the client and
+ * server sockets with splice(2) through a pipe per direction, so they are
+ * never copied into user space.  pump() is called from the event loop
+ * when the source is readable or the destination writable and moves as
+ * much as it can without blocking.
+ *
+ * Built with HAVE_IO_URING (only the kernel headers are needed), the
+ * same splices can instead be queued on a SpliceRing with submit() and
+ * accounted for with complete().  Each splice is linked behind a poll
+ * on its socket, so it runs only once the socket is ready, and reads
+ * and writes are queued as two independent chains: a short read just
+ * leaves less for the next write, and nothing is read while the pipe
+ * is full.  A direction is driven either by pump() or by the ring,
+ * never both.
+ */
+
+namespace Service {
+
+#ifdef HAVE_IO_URING
+    class SpliceRing;
+#endif
+
+    class SpliceTunnel {
+    public:
+        enum Status { OPEN, CLOSED, ERROR };
+
+        static const size_t CHUNK = 64 * 1024;
+
+        struct Direction {
+            int from;
+            int to;
+            int pipe[2];
+            size_t capacity;        // of this direction's pipe
+            size_t buffered;        // bytes sitting in the pipe
+            bool eof;
+            bool closed;
+            bool reading;           // io_uring read chain queued
+            bool writing;           // io_uring write chain queued
+            bool stalled;           // pipe refused data, wait for a write
+            uint64_t bytes;         // bytes delivered to 'to'
+        };
+
+        Direction upstream;         // client to server
+        Direction downstream;       // server to client
+
+    private:
+        bool open( Direction& d, int from, int to ) {
+            d.from = from;
+            d.to = to;
+            d.capacity = CHUNK;
+            d.buffered = 0;
+            d.eof = false;
+            d.closed = false;
+            d.reading = false;
+            d.writing = false;
+            d.stalled = false;
+            d.bytes = 0;
+            if ( pipe2(d.pipe, O_NONBLOCK | O_CLOEXEC) != 0 ) {
+                d.pipe[0] = d.pipe[1] = -1;
+                return false;
+            }
+            int size = fcntl( d.pipe[1], F_SETPIPE_SZ, (int)CHUNK );
+            if ( size <= 0 ) size = fcntl( d.pipe[1], F_GETPIPE_SZ );
+            if ( size > 0 ) d.capacity = size;
+            return true;
+        }
+        void close( Direction& d ) {
+            if ( d.pipe[0] >= 0 ) ::close( d.pipe[0] );
+            if ( d.pipe[1] >= 0 ) ::close( d.pipe[1] );
+            d.pipe[0] = d.pipe[1] = -1;
+        }
+        Status finish( Direction& d ) {
+            if ( d.closed == false ) {
+                shutdown( d.to, SHUT_WR );
+                d.closed = true;
+            }
+            return CLOSED;
+        }
+
+    public:
+        SpliceTunnel( int client, int server ) {
+            bool ok = open( upstream, client, server );
+            ok = open( downstream, server, client ) && ok;
+            if ( ok == false ) {
+                UINFO( 1, "SpliceTunnel: cannot create pipes, errno " << errno << endl );
+            }
+        }
+        ~SpliceTunnel() {
+            close( upstream );
+            close( downstream );
+        }
+
+        bool valid() const {
+            return upstream.pipe[0] >= 0 && downstream.pipe[0] >= 0;
+        }
+
+        /*
+         * Interest the event loop should register for a direction.
+         */
+        bool wantsRead( const Direction& d ) const {
+            return d.eof == false && d.buffered < d.capacity;
+        }
+        bool wantsWrite( const Direction& d ) const {
+            return d.buffered > 0;
+        }
+
+        Status pump( Direction& d ) {
+            if ( d.closed ) return CLOSED;
+            for (;;) {
+                bool progress = false;
+                if ( d.eof == false && d.buffered < d.capacity ) {
+                    ssize_t n = splice( d.from, NULL, d.pipe[1], NULL, d.capacity - d.buffered,
+                                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+                    if ( n > 0 ) {
+                        d.buffered += n;
+                        progress = true;
+                    } else if ( n == 0 ) {
+                        d.eof = true;
+                        progress = true;
+                    } else if ( errno != EAGAIN && errno != EINTR ) {
+                        return ERROR;
+                    }
+                }
+                if ( d.buffered > 0 ) {
+                    ssize_t n = splice( d.pipe[0], NULL, d.to, NULL, d.buffered,
+                                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (d.eof ? 0 : SPLICE_F_MORE) );
+                    if ( n > 0 ) {
+                        d.buffered -= n;
+                        d.bytes += n;
+                        progress = true;
+                    } else if ( n < 0 && errno != EAGAIN && errno != EINTR ) {
+                        return ERROR;
+                    }
+                }
+                if ( d.eof && d.buffered == 0 ) return finish( d );
+                if ( progress == false ) return OPEN;
+            }
+        }
+
+        /*
+         * Both directions have seen end of file and drained.
+         */
+        bool done() const { return upstream.closed && downstream.closed; }
+
+    #ifdef HAVE_IO_URING
+        /*
+         * The low two bits of a request's user_data.
+         */
+        enum Request { READ_POLL = 0, READ_SPLICE = 1, WRITE_POLL = 2, WRITE_SPLICE = 3 };
+
+        /*
+         * Queue whatever a direction needs and is not already queued: a
+         * read chain while it has not seen end of file and the pipe has
+         * room, a write chain while the pipe holds data.  user_data is
+         * tag plus a Request, so tag must be 4-byte aligned.  Returns
+         * false if the ring had no room for a chain that was needed; call
+         * again after the next completion.
+         */
+        bool submit( SpliceRing& ring, Direction& d, uintptr_t tag );
+
+        /*
+         * Account for the completion of a request queued by submit().
+         * Call submit() for the direction afterwards to keep it moving.
+         */
+        Status complete( Direction& d, uintptr_t data, int result ) {
+            if ( d.closed ) return CLOSED;
+            switch ( data & 3 ) {
+            case READ_POLL:
+            case WRITE_POLL:
+                // a failed poll cancels its splice, which clears the flag
+                if ( result < 0 && result != -ECANCELED && result != -EINTR ) return ERROR;
+                return OPEN;
+            case READ_SPLICE:
+                d.reading = false;
+                if ( result > 0 ) {
+                    d.buffered += result;
+                } else if ( result == 0 ) {
+                    d.eof = true;
+                } else if ( result == -EAGAIN ) {
+                    // with data in the pipe it is the pipe that is full
+                    if ( d.buffered > 0 ) d.stalled = true;
+                } else if ( result != -ECANCELED && result != -EINTR ) {
+                    return ERROR;
+                }
+                break;
+            case WRITE_SPLICE:
+                d.writing = false;
+                if ( result > 0 ) {
+                    d.buffered -= result;
+                    d.bytes += result;
+                    d.stalled = false;
+                } else if ( result < 0 && result != -EAGAIN &&
+                            result != -ECANCELED && result != -EINTR ) {
+                    return ERROR;
+                }
+                break;
+            }
+            if ( d.eof && d.buffered == 0 && d.writing == false ) return finish( d );
+            return OPEN;
+        }
+    #endif
+    };
+
+#ifdef HAVE_IO_URING
+    /*
+     * A minimal io_uring on the raw system calls, just enough to queue
+     * linked poll and splice requests and read their completions.
+     */
+    class SpliceRing {
+        int fd;
+        void *sqRing;
+        size_t sqSize;
+        void *cqRing;
+        size_t cqSize;
+        struct io_uring_sqe *sqes;
+        size_t sqesSize;
+        volatile unsigned *sqHead;
+        volatile unsigned *sqTail;
+        unsigned sqMask;
+        unsigned sqEntries;
+        unsigned *sqArray;
+        volatile unsigned *cqHead;
+        volatile unsigned *cqTail;
+        unsigned cqMask;
+        struct io_uring_cqe *cqes;
+        unsigned tail;              // next free sqe, published by submit()
+
+    public:
+        SpliceRing( unsigned entries = 64 )
+        : fd(-1), sqRing(MAP_FAILED), sqSize(0), cqRing(MAP_FAILED), cqSize(0),
+          sqes((struct io_uring_sqe *)MAP_FAILED), sqesSize(0), tail(0) {
+            struct io_uring_params p;
+            memset( &p, 0, sizeof(p) );
+            fd = syscall( __NR_io_uring_setup, entries, &p );
+            if ( fd < 0 ) {
+                UINFO( 1, "SpliceRing: io_uring_setup failed, errno " << errno << endl );
+                return;
+            }
+            sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+            if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+                if ( cqSize > sqSize ) sqSize = cqSize;
+                cqSize = sqSize;
+            }
+            sqRing = mmap( 0, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd, IORING_OFF_SQ_RING );
+            if ( sqRing == MAP_FAILED ) return;
+            if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+                cqRing = sqRing;
+            } else {
+                cqRing = mmap( 0, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               fd, IORING_OFF_CQ_RING );
+                if ( cqRing == MAP_FAILED ) return;
+            }
+            sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+            sqes = (struct io_uring_sqe *)mmap( 0, sqesSize, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+            if ( sqes == MAP_FAILED ) return;
+
+            char *sq = (char *)sqRing;
+            sqHead = (unsigned *)( sq + p.sq_off.head );
+            sqTail = (unsigned *)( sq + p.sq_off.tail );
+            sqMask = *(unsigned *)( sq + p.sq_off.ring_mask );
+            sqEntries = *(unsigned *)( sq + p.sq_off.ring_entries );
+            sqArray = (unsigned *)( sq + p.sq_off.array );
+            char *cq = (char *)cqRing;
+            cqHead = (unsigned *)( cq + p.cq_off.head );
+            cqTail = (unsigned *)( cq + p.cq_off.tail );
+            cqMask = *(unsigned *)( cq + p.cq_off.ring_mask );
+            cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+            tail = *sqTail;
+        }
+        ~SpliceRing() {
+            if ( sqes != MAP_FAILED ) munmap( sqes, sqesSize );
+            if ( cqRing != MAP_FAILED && cqRing != sqRing ) munmap( cqRing, cqSize );
+            if ( sqRing != MAP_FAILED ) munmap( sqRing, sqSize );
+            if ( fd >= 0 ) ::close( fd );
+        }
+
+        bool valid() const { return fd >= 0 && sqes != MAP_FAILED; }
+
+        /*
+         * Free submission entries.
+         */
+        unsigned space() const {
+            __sync_synchronize();
+            return sqEntries - ( tail - *sqHead );
+        }
+
+        /*
+         * A cleared submission entry, or NULL if the ring is full.  It
+         * is handed to the kernel by the next submit().
+         */
+        struct io_uring_sqe *next() {
+            if ( space() == 0 ) return 0;
+            unsigned index = tail & sqMask;
+            struct io_uring_sqe *sqe = &sqes[index];
+            memset( sqe, 0, sizeof(*sqe) );
+            sqArray[index] = index;
+            tail++;
+            return sqe;
+        }
+
+        /*
+         * Publish the queued entries and enter the kernel, waiting for at
+         * least wait completions.  Returns the number of entries
+         * consumed, or -1 with errno set.
+         */
+        int submit( unsigned wait = 0 ) {
+            unsigned count = tail - *sqTail;
+            __sync_synchronize();
+            *sqTail = tail;
+            __sync_synchronize();
+            if ( count == 0 && wait == 0 ) return 0;
+            return syscall( __NR_io_uring_enter, fd, count, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+        }
+
+        /*
+         * Pop one completion.  False if there is none.
+         */
+        bool reap( uintptr_t *data, int *result ) {
+            unsigned head = *cqHead;
+            __sync_synchronize();
+            if ( head == *cqTail ) return false;
+            struct io_uring_cqe *cqe = &cqes[head & cqMask];
+            *data = (uintptr_t)cqe->user_data;
+            *result = cqe->res;
+            __sync_synchronize();
+            *cqHead = head + 1;
+            return true;
+        }
+    };
+
+    inline bool SpliceTunnel::submit( SpliceRing& ring, Direction& d, uintptr_t tag ) {
+        if ( d.closed ) return true;
+        bool queued = true;
+        if ( d.reading == false && d.stalled == false && wantsRead(d) ) {
+            if ( ring.space() < 2 ) {
+                queued = false;
+            } else {
+                struct io_uring_sqe *poll = ring.next();
+                poll->opcode = IORING_OP_POLL_ADD;
+                poll->fd = d.from;
+                poll->poll32_events = POLLIN | POLLRDHUP;
+                poll->flags = IOSQE_IO_LINK;
+                poll->user_data = tag | READ_POLL;
+                struct io_uring_sqe *in = ring.next();
+                in->opcode = IORING_OP_SPLICE;
+                in->splice_fd_in = d.from;
+                in->splice_off_in = (uint64_t)-1;
+                in->fd = d.pipe[1];
+                in->off = (uint64_t)-1;
+                in->len = d.capacity - d.buffered;
+                in->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+                in->user_data = tag | READ_SPLICE;
+                d.reading = true;
+            }
+        }
+        if ( d.writing == false && d.buffered > 0 ) {
+            if ( ring.space() < 2 ) {
+                queued = false;
+            } else {
+                struct io_uring_sqe *poll = ring.next();
+                poll->opcode = IORING_OP_POLL_ADD;
+                poll->fd = d.to;
+                poll->poll32_events = POLLOUT;
+                poll->flags = IOSQE_IO_LINK;
+                poll->user_data = tag | WRITE_POLL;
+                struct io_uring_sqe *out = ring.next();
+                out->opcode = IORING_OP_SPLICE;
+                out->splice_fd_in = d.pipe[0];
+                out->splice_off_in = (uint64_t)-1;
+                out->fd = d.to;
+                out->off = (uint64_t)-1;
+                out->len = d.buffered;
+                out->splice_flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (d.eof ? 0 : SPLICE_F_MORE);
+                out->user_data = tag | WRITE_SPLICE;
+                d.writing = true;
+            }
+        }
+        return queued;
+    }
+#endif
+}
+#endif
+
+/* vim: set autoindent expandtab sw=4 : */
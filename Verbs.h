@@ -24,6 +24,8 @@
 #include <stdint.h>
 #include "tcl.h"
 #include "crc32.h"
+#include "ConsistentHash.h"
+#include "Dependencies.h"
 
 #ifndef _OBJECTPOLICY_H_
 #define _OBJECTPOLICY_H_
@@ -39,6 +41,7 @@ namespace Service {
         virtual ~Verb() {}
         virtual void destroy(Pool *);
         virtual void operator() ( Context& ) = 0;
+        virtual void depends( Dependencies& d ) { d.unknown(); }
         void * operator new ( std::size_t, Pool * );
         void operator delete ( void * ) {}
     };
@@ -49,6 +52,7 @@ namespace Service {
         virtual ~NullVerb() {}
         virtual void destroy(Pool *);
         virtual void operator() (Context&);
+        virtual void depends( Dependencies& d ) { }
     };
 
     class IfVerb : public Verb {
@@ -60,6 +64,11 @@ namespace Service {
         virtual ~IfVerb() {}
         virtual void destroy(Pool *);
         virtual void operator() (Context&);
+        virtual void depends( Dependencies& d ) {
+            predicate->depends( d );
+            block->depends( d );
+            if ( next ) next->depends( d );
+        }
     };
 
     class Selection {
@@ -84,6 +93,13 @@ namespace Service {
         virtual ~Cond() {}
         virtual void destroy(Pool *);
         virtual void operator() (Context&);
+        virtual void depends( Dependencies& d ) {
+            for ( Selection *s = selection ; s ; s = s->next ) {
+                s->predicate->depends( d );
+                s->block->depends( d );
+            }
+            if ( next ) next->depends( d );
+        }
     };
 
     class fpID : public Verb {
@@ -94,6 +110,7 @@ namespace Service {
         virtual ~fpID() {}
         virtual void destroy(Pool *);
         virtual void operator() ( Context & );
+        virtual void depends( Dependencies& d ) { if ( next ) next->depends( d ); }
     };
 
     class tunnel : public Verb {
@@ -102,6 +119,7 @@ namespace Service {
         virtual ~tunnel() {}
         virtual void destroy(Pool *);
         virtual void operator() ( Context & );
+        virtual void depends( Dependencies& d ) { if ( next ) next->depends( d ); }
     };
 
     class cookiePersist : public Verb {
@@ -122,6 +140,7 @@ namespace Service {
         virtual ~dont_retry() {}
         virtual void destroy(Pool *);
         virtual void operator() ( Context & );
+        virtual void depends( Dependencies& d ) { if ( next ) next->depends( d ); }
     };
 
     class closeOptim : public Verb {
@@ -130,16 +149,34 @@ namespace Service {
         virtual ~closeOptim() {}
         virtual void destroy(Pool *);
         virtual void operator() ( Context & );
+        virtual void depends( Dependencies& d ) { if ( next ) next->depends( d ); }
     };
 
     class stickyVariable : public Verb {
         IntegerCoercion *coercion;
+        ConsistentHash *backends;
     public:
         stickyVariable( IntegerCoercion *coercion, Verb *verb )
-        : Verb(verb), coercion(coercion) { }
+        : Verb(verb), coercion(coercion), backends(0) { }
         virtual ~stickyVariable() {}
         virtual void destroy(Pool *);
         virtual void operator() ( Context& );
+        virtual void depends( Dependencies& d ) {
+            coercion->depends( d );
+            d.uncacheable();
+            if ( next ) next->depends( d );
+        }
+
+        void setBackends( ConsistentHash *table ) { backends = table; }
+
+        /*
+         * Backend index for this request from the pool's Maglev table,
+         * or Maglev::EMPTY when no table is attached or the pool is empty.
+         */
+        uint32_t select( Context& context ) {
+            if ( backends == 0 ) return Maglev::EMPTY;
+            return backends->lookup( (*coercion)(&context) );
+        }
     };
 
     class cookieNOOP : public Verb {
@@ -148,6 +185,7 @@ namespace Service {
         virtual ~cookieNOOP() {}
         virtual void destroy(Pool *);
         virtual void operator() ( Context &state ) { (*next)( state ); }
+        virtual void depends( Dependencies& d ) { if ( next ) next->depends( d ); }
     };
 
     bool Initialize( Tcl_Interp *, OPE * );
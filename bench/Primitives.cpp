@@ -0,0 +1,353 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks for the AST evaluators.
+ *
+ *     Primitives [filter]
+ *
+ * Runs every case whose name contains filter.  Each case times one
+ * primitive or one synthetic policy shape against a small corpus of
+ * real world HTTP header values so that new fast paths can be compared
+ * against the existing ones.
+ */
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include "tcl.h"
+#include "String.h"
+#include "Verbs.h"
+#include "FieldTable.h"
+#include "Benchmark.h"
+
+using namespace Service;
+using namespace Service::Benchmark;
+
+volatile uint64_t Service::Benchmark::sink;
+
+namespace {
+
+    Pool pool;
+    Context context;
+
+    const char *hosts[] = {
+        "www.example.com", "api.example.com", "static.example.net",
+        "images.cdn.example.org", "login.example.com", "example.com",
+        "m.example.com", "www.example.co.uk", "shop.example.com",
+        "telemetry.example.io", "10.1.2.3", "localhost",
+    };
+    const char *agents[] = {
+        "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36",
+        "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.0 Safari/605.1.15",
+        "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0",
+        "curl/8.4.0",
+        "Googlebot/2.1 (+http://www.google.com/bot.html)",
+    };
+    const char *values[] = {
+        "GET", "POST", "HEAD", "HTTP/1.1", "HTTP/1.0",
+        "keep-alive", "close", "gzip, deflate, br", "chunked",
+        "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+        "en-US,en;q=0.5", "no-cache", "websocket",
+        "SESSIONID=8f2a7c1e9b4d; theme=dark; _ga=GA1.2.1234567890.1697712345; lang=en",
+    };
+
+    const uint32_t CORPUS = 64;
+    String corpus[CORPUS];
+    Field fields[CORPUS];
+
+    void fill( String *s, const char *value ) {
+        s->start = (char *)value;
+        s->length = strlen( value );
+        s->value = 0;
+        s->count = 1;
+        s->allocated = false;
+    }
+
+    void load() {
+        static bool loaded = false;
+        if ( loaded ) return;
+        const uint32_t nh = sizeof(hosts) / sizeof(hosts[0]);
+        const uint32_t na = sizeof(agents) / sizeof(agents[0]);
+        const uint32_t nv = sizeof(values) / sizeof(values[0]);
+        for ( uint32_t i = 0 ; i < CORPUS ; i++ ) {
+            const char *s;
+            switch ( i % 3 ) {
+            case 0:  s = hosts[i % nh];  break;
+            case 1:  s = agents[i % na]; break;
+            default: s = values[i % nv]; break;
+            }
+            fill( &corpus[i], s );
+            fill( &fields[i], s );
+            fields[i].value = strlen( s );
+        }
+        loaded = true;
+    }
+
+    /*
+     * String compares
+     */
+    class StringEqual : public Case {
+        String literal;
+    public:
+        StringEqual() : Case("String::eq corpus") { }
+        virtual void setup() { load(); fill( &literal, "www.example.com" ); }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) {
+                hits += corpus[i % CORPUS].eq( &literal );
+            }
+            sink += hits;
+        }
+    } stringEqual;
+
+    class StringEqualLong : public Case {
+        String a, b;
+    public:
+        StringEqualLong() : Case("String::eq long equal") { }
+        virtual void setup() { fill( &a, agents[0] ); fill( &b, agents[0] ); }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) hits += a.eq( &b );
+            sink += hits;
+        }
+    } stringEqualLong;
+
+    class StringLess : public Case {
+        String literal;
+    public:
+        StringLess() : Case("String::lt corpus") { }
+        virtual void setup() { load(); fill( &literal, "m" ); }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) {
+                hits += corpus[i % CORPUS].lt( &literal );
+            }
+            sink += hits;
+        }
+    } stringLess;
+
+    /*
+     * Field clearing
+     */
+    class Clear : public Case {
+        uint32_t count;
+        Field *table;
+    public:
+        Clear( const char *name, uint32_t count )
+        : Case(name), count(count), table(0) { }
+        virtual void setup() { if ( table == 0 ) table = new Field[count]; }
+        virtual void operator () ( uint64_t n ) {
+            for ( uint64_t i = 0 ; i < n ; i++ ) ClearFields( count, table );
+            sink += table[0].length;
+        }
+    };
+    Clear clear8( "ClearFields 8", 8 );
+    Clear clear64( "ClearFields 64", 64 );
+    Clear clear200( "ClearFields 200", 200 );
+
+    class ClearTable : public Case {
+        uint32_t count;
+        FieldTable *table;
+    public:
+        ClearTable( const char *name, uint32_t count )
+        : Case(name), count(count), table(0) { }
+        virtual void setup() { if ( table == 0 ) table = new FieldTable( count ); }
+        virtual void operator () ( uint64_t n ) {
+            for ( uint64_t i = 0 ; i < n ; i++ ) ClearFields( *table );
+            sink += table->length[0];
+        }
+    };
+    ClearTable clearTable8( "ClearFields table 8", 8 );
+    ClearTable clearTable64( "ClearFields table 64", 64 );
+    ClearTable clearTable200( "ClearFields table 200", 200 );
+
+    /*
+     * Coercion + comparison predicates
+     */
+    template <class Compare>
+    class FieldValueCompare : public Case {
+        Predicate *predicate;
+    public:
+        FieldValueCompare( const char *name ) : Case(name), predicate(0) { }
+        virtual void setup() {
+            load();
+            if ( predicate ) return;
+            predicate = new (&pool) Compare( new (&pool) FieldValue(&fields[3]), 100 );
+        }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) hits += (*predicate)( &context );
+            sink += hits;
+        }
+    };
+    FieldValueCompare<i_ge_r_i> fieldValueCompare( "i_ge_r_i FieldValue" );
+    FieldValueCompare<i_ge_fv_i> fieldValueDirect( "i_ge_fv_i FieldValue" );
+
+    class FieldStringCompare : public Case {
+        Predicate *predicate[CORPUS];
+        bool built;
+    public:
+        FieldStringCompare() : Case("s_eq_r_i FieldString"), built(false) { }
+        virtual void setup() {
+            load();
+            if ( built ) return;
+            String *literal = String::literal( &pool, "keep-alive" );
+            for ( uint32_t i = 0 ; i < CORPUS ; i++ ) {
+                predicate[i] = new (&pool) s_eq_r_i( new (&pool) FieldString(&fields[i]), literal );
+            }
+            built = true;
+        }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) {
+                hits += (*predicate[i % CORPUS])( &context );
+            }
+            sink += hits;
+        }
+    } fieldStringCompare;
+
+    /*
+     * Synthetic predicate tree shapes
+     */
+    class Tree : public Case {
+        bool conjunction;
+        uint32_t depth;
+        Predicate *root;
+    public:
+        Tree( const char *name, bool conjunction, uint32_t depth )
+        : Case(name), conjunction(conjunction), depth(depth), root(0) { }
+        virtual void setup() {
+            if ( root ) return;
+            // AND of T and OR of F both have to visit every leaf
+            root = conjunction ? (Predicate *)new (&pool) T() : (Predicate *)new (&pool) F();
+            for ( uint32_t i = 1 ; i < depth ; i++ ) {
+                Predicate *leaf = conjunction ? (Predicate *)new (&pool) T() : (Predicate *)new (&pool) F();
+                if ( conjunction ) root = new (&pool) AND( leaf, root );
+                else               root = new (&pool) OR( leaf, root );
+            }
+        }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) hits += (*root)( &context );
+            sink += hits;
+        }
+    };
+    Tree and16( "AND tree depth 16", true, 16 );
+    Tree and256( "AND tree depth 256", true, 256 );
+    Tree or16( "OR tree depth 16", false, 16 );
+    Tree or256( "OR tree depth 256", false, 256 );
+
+    class CondChain : public Case {
+        uint32_t length;
+        Verb *verb;
+    public:
+        CondChain( const char *name, uint32_t length )
+        : Case(name), length(length), verb(0) { }
+        virtual void setup() {
+            load();
+            if ( verb ) return;
+            // only the last selection matches so every predicate runs
+            Selection *chain = new (&pool) Selection(
+                new (&pool) T(), new (&pool) NullVerb(), 0 );
+            for ( uint32_t i = 1 ; i < length ; i++ ) {
+                Predicate *p = new (&pool) i_eq_r_i( new (&pool) FieldValue(&fields[i % CORPUS]), 0xffffffff );
+                chain = new (&pool) Selection( p, new (&pool) NullVerb(), chain );
+            }
+            verb = new (&pool) Cond( chain, new (&pool) NullVerb() );
+        }
+        virtual void operator () ( uint64_t n ) {
+            for ( uint64_t i = 0 ; i < n ; i++ ) (*verb)( context );
+            sink += n;
+        }
+    };
+    CondChain cond8( "Cond chain 8", 8 );
+    CondChain cond128( "Cond chain 128", 128 );
+
+    /*
+     * Globs
+     */
+    class Globs : public Case {
+        uint32_t count;
+        Glob **globs;
+    public:
+        Globs( const char *name, uint32_t count )
+        : Case(name), count(count), globs(0) { }
+        virtual void setup() {
+            load();
+            if ( globs ) return;
+            const char *shapes[] = { "*.example.com", "www.*", "*cdn*", "api.example.*", "*.co.uk", "?.example.com" };
+            const uint32_t ns = sizeof(shapes) / sizeof(shapes[0]);
+            globs = new Glob *[count];
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                globs[i] = new (&pool) Glob( &pool, shapes[i % ns] );
+            }
+        }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) {
+                String& subject = corpus[(i * 3) % CORPUS];
+                for ( uint32_t g = 0 ; g < count ; g++ ) {
+                    if ( globs[g]->match(subject.start, subject.length) ) { hits++; break; }
+                }
+            }
+            sink += hits;
+        }
+    };
+    Globs globs1( "Glob::match 1 pattern", 1 );
+    Globs globs64( "Glob::match 64 patterns", 64 );
+
+    /*
+     * CIDR lists, written the way policies write them today: an OR
+     * chain of AddressMatches.
+     */
+    class CIDRList : public Case {
+        uint32_t count;
+        Predicate *root;
+    public:
+        CIDRList( const char *name, uint32_t count )
+        : Case(name), count(count), root(0) { }
+        virtual void setup() {
+            if ( root ) return;
+            root = new (&pool) F();
+            for ( uint32_t i = 0 ; i < count ; i++ ) {
+                uint32_t address = 0x0a000000 | (i << 8);
+                root = new (&pool) OR( new (&pool) AddressMatches(address, 24), root );
+            }
+        }
+        virtual void operator () ( uint64_t n ) {
+            uint64_t hits = 0;
+            for ( uint64_t i = 0 ; i < n ; i++ ) hits += (*root)( &context );
+            sink += hits;
+        }
+    };
+    CIDRList cidr16( "AddressMatches OR 16", 16 );
+    CIDRList cidr1024( "AddressMatches OR 1024", 1024 );
+}
+
+int
+main( int argc, char **argv ) {
+    return Service::Benchmark::run( argc > 1 ? argv[1] : NULL );
+}
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,237 @@
+
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Replay a header capture through a policy.
+ *
+ *     Replay policy.tcl|builtin capture.txt [threads] [passes]
+ *
+ * Reports throughput, per exchange latency percentiles and heap
+ * allocations per exchange, counted by interposing malloc().
+ *
+ * Policy scripts are loaded by LoadPolicy(), which the embedding
+ * service links in.  "builtin" runs a small policy built here instead,
+ * host and path routing on the request and a status check on the
+ * response, so the harness runs from this tree alone.
+ */
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include "tcl.h"
+#include "String.h"
+#include "Verbs.h"
+#include "Program.h"
+#include "Replay.h"
+
+using namespace Service;
+
+extern "C" {
+    extern void *__libc_malloc( size_t );
+    extern void *__libc_calloc( size_t, size_t );
+    extern void *__libc_realloc( void *, size_t );
+
+    void *malloc( size_t size ) {
+        Replay::allocations()++;
+        return __libc_malloc( size );
+    }
+    void *calloc( size_t n, size_t size ) {
+        Replay::allocations()++;
+        return __libc_calloc( n, size );
+    }
+    void *realloc( void *p, size_t size ) {
+        Replay::allocations()++;
+        return __libc_realloc( p, size );
+    }
+}
+
+/*
+ * Provided by the embedding service, which owns the OPE and the header
+ * parser: evaluate the policy script in a fresh interpreter, bind the
+ * header names its Fields were created for and hand back the programs
+ * and a Context to run them with.  Weak, so the harness links without
+ * it and offers only the builtin policy.
+ */
+extern bool LoadPolicy( const char *path,
+                        Replay::Binding& request, Replay::Binding& response,
+                        RequestProgram **, ResponseProgram **, Context ** )
+    __attribute__((weak));
+
+namespace {
+    class PolicyLoader : public Replay::Loader {
+        const char *path;
+        pthread_mutex_t lock;
+    public:
+        PolicyLoader( const char *path ) : path(path) {
+            pthread_mutex_init( &lock, NULL );
+        }
+        virtual bool operator () ( Replay::Binding& request, Replay::Binding& response,
+                                   RequestProgram **rq, ResponseProgram **rs,
+                                   Context **context ) {
+            // Tcl_Interp creation and Initialize() are not thread safe
+            pthread_mutex_lock( &lock );
+            bool ok = LoadPolicy( path, request, response, rq, rs, context );
+            pthread_mutex_unlock( &lock );
+            return ok;
+        }
+    };
+
+    /*
+     * The builtin policy.  Every thread gets its own Pool, Fields,
+     * programs and Context; nothing is ever freed, the process exits.
+     */
+    class BuiltinLoader : public Replay::Loader {
+        enum {
+            METHOD, URI, REQUEST_VERSION, HOST, USER_AGENT, COOKIE,
+            RESPONSE_VERSION, STATUS, UPGRADE, SET_COOKIE,
+            CONNECTION, CONTENT_LENGTH, TRANSFER_ENCODING, KEEP_ALIVE,
+            EXPECT, RANGE,
+            RESPONSE_CONNECTION, RESPONSE_CONTENT_LENGTH,
+            RESPONSE_TRANSFER_ENCODING, RESPONSE_KEEP_ALIVE,
+            FIELDS
+        };
+    public:
+        virtual bool operator () ( Replay::Binding& request, Replay::Binding& response,
+                                   RequestProgram **rq, ResponseProgram **rs,
+                                   Context **context ) {
+            Pool *pool = new Pool;
+            Field *f = new Field[FIELDS];
+
+            request.bind( ":method", &f[METHOD] );
+            request.bind( ":uri", &f[URI] );
+            request.bind( ":version", &f[REQUEST_VERSION] );
+            request.bind( "Host", &f[HOST] );
+            request.bind( "User-Agent", &f[USER_AGENT] );
+            request.bind( "Cookie", &f[COOKIE] );
+            request.bind( "Connection", &f[CONNECTION] );
+            request.bind( "Content-Length", &f[CONTENT_LENGTH] );
+            request.bind( "Transfer-Encoding", &f[TRANSFER_ENCODING] );
+            request.bind( "Keep-Alive", &f[KEEP_ALIVE] );
+            request.bind( "Expect", &f[EXPECT] );
+            request.bind( "Range", &f[RANGE] );
+            response.bind( ":version", &f[RESPONSE_VERSION] );
+            response.bind( ":status", &f[STATUS] );
+            response.bind( "Upgrade", &f[UPGRADE] );
+            response.bind( "Set-Cookie", &f[SET_COOKIE] );
+            response.bind( "Connection", &f[RESPONSE_CONNECTION] );
+            response.bind( "Content-Length", &f[RESPONSE_CONTENT_LENGTH] );
+            response.bind( "Transfer-Encoding", &f[RESPONSE_TRANSFER_ENCODING] );
+            response.bind( "Keep-Alive", &f[RESPONSE_KEEP_ALIVE] );
+
+            // most specific first, as policies are written
+            Selection *routes =
+                new (pool) Selection( new (pool) AND(
+                                          new (pool) s_eq_r_i( new (pool) FieldString(&f[METHOD]),
+                                                               String::literal(pool, "POST") ),
+                                          new (pool) i_gt_fv_i( new (pool) FieldValue(&f[CONTENT_LENGTH]),
+                                                                1024 * 1024 ) ),
+                                      new (pool) NullVerb(),
+                new (pool) Selection( new (pool) s_prefix_r_i( new (pool) FieldString(&f[URI]),
+                                                               String::literal(pool, "/api/") ),
+                                      new (pool) NullVerb(),
+                new (pool) Selection( new (pool) Matches( new (pool) FieldString(&f[HOST]),
+                                                          new (pool) Glob(pool, "*.example.com") ),
+                                      new (pool) NullVerb(),
+                new (pool) Selection( new (pool) Matches( new (pool) FieldString(&f[USER_AGENT]),
+                                                          new (pool) Glob(pool, "*bot*") ),
+                                      new (pool) NullVerb(), 0 ) ) ) );
+            RequestProgram *requestProgram =
+                new (pool) RequestProgram( new (pool) Cond(routes, new (pool) NullVerb()) );
+            requestProgram->set_METHOD( &f[METHOD] );
+            requestProgram->set_REQUEST_VERSION( &f[REQUEST_VERSION] );
+            requestProgram->set_CONNECTION( &f[CONNECTION] );
+            requestProgram->set_CONTENT_LENGTH( &f[CONTENT_LENGTH] );
+            requestProgram->set_TRANSFER_ENCODING( &f[TRANSFER_ENCODING] );
+            requestProgram->set_KeepAlive( &f[KEEP_ALIVE] );
+            requestProgram->set_Expect( &f[EXPECT] );
+            requestProgram->set_Range( &f[RANGE] );
+
+            Selection *outcomes =
+                new (pool) Selection( new (pool) i_ge_fv_i( new (pool) FieldValue(&f[STATUS]), 500 ),
+                                      new (pool) NullVerb(),
+                new (pool) Selection( new (pool) present( new (pool) FieldString(&f[UPGRADE]) ),
+                                      new (pool) NullVerb(),
+                new (pool) Selection( new (pool) present( new (pool) FieldString(&f[SET_COOKIE]) ),
+                                      new (pool) NullVerb(), 0 ) ) );
+            ResponseProgram *responseProgram =
+                new (pool) ResponseProgram( new (pool) Cond(outcomes, new (pool) NullVerb()) );
+            responseProgram->set_RESPONSE_VERSION( &f[RESPONSE_VERSION] );
+            responseProgram->set_RESPONSE_CODE( &f[STATUS] );
+            responseProgram->set_Upgrade( &f[UPGRADE] );
+            responseProgram->set_CONNECTION( &f[RESPONSE_CONNECTION] );
+            responseProgram->set_CONTENT_LENGTH( &f[RESPONSE_CONTENT_LENGTH] );
+            responseProgram->set_TRANSFER_ENCODING( &f[RESPONSE_TRANSFER_ENCODING] );
+            responseProgram->set_KeepAlive( &f[RESPONSE_KEEP_ALIVE] );
+
+            *rq = requestProgram;
+            *rs = responseProgram;
+            *context = new Context;
+            return true;
+        }
+    };
+}
+
+int
+main( int argc, char **argv ) {
+    if ( argc < 3 ) {
+        fprintf( stderr, "usage: %s policy|builtin capture [threads] [passes]\n", argv[0] );
+        return 1;
+    }
+    uint32_t threads = ( argc > 3 ) ? atoi( argv[3] ) : 1;
+    uint32_t passes  = ( argc > 4 ) ? atoi( argv[4] ) : 100;
+
+    Replay::Capture capture;
+    if ( capture.load(argv[2]) == false ) {
+        fprintf( stderr, "%s: cannot load capture\n", argv[2] );
+        return 1;
+    }
+
+    bool builtin = ( strcmp(argv[1], "builtin") == 0 );
+    if ( builtin == false && LoadPolicy == 0 ) {
+        fprintf( stderr, "%s: no policy loader linked in, use builtin\n", argv[1] );
+        return 1;
+    }
+    PolicyLoader policy( argv[1] );
+    BuiltinLoader compiled;
+    Replay::Loader& loader = builtin ? (Replay::Loader&)compiled : (Replay::Loader&)policy;
+    Replay::Runner runner( capture, loader, passes );
+    Replay::Result result;
+    if ( runner.run(threads, &result) == false ) {
+        fprintf( stderr, "%s: replay failed\n", argv[1] );
+        return 1;
+    }
+
+    double seconds = result.elapsed / 1e9;
+    printf( "threads        %u\n", threads );
+    printf( "exchanges      %llu\n", (unsigned long long)result.exchanges );
+    printf( "throughput     %.0f exchanges/s\n", result.exchanges / seconds );
+    printf( "latency p50    %llu ns\n", (unsigned long long)result.p50 );
+    printf( "latency p99    %llu ns\n", (unsigned long long)result.p99 );
+    printf( "latency p999   %llu ns\n", (unsigned long long)result.p999 );
+    printf( "allocations    %.3f per exchange\n",
+            result.exchanges ? (double)result.allocations / result.exchanges : 0.0 );
+    return 0;
+}
+
+/* vim: set autoindent expandtab sw=4 : */
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2012 Karl N. Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Push data through a SpliceTunnel in both directions and check it.
+ *
+ *     Tunnel [megabytes]
+ *
+ * A client and a server thread each write a pseudo random stream in
+ * writes of random size, shut down and read the other side's stream
+ * back with occasional pauses, so the pipes fill up and splices come
+ * back short.  The tunnel is driven with pump() and, when built with
+ * HAVE_IO_URING, with a SpliceRing.  Exits non-zero if a byte is lost,
+ * reordered or altered, or end of file is not passed on.
+ */
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstdio>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "tcl.h"
+#include "Tunnel.h"
+
+using namespace Service;
+
+namespace {
+
+    uint64_t total;
+
+    inline uint8_t expected( uint32_t seed, uint64_t i ) {
+        uint64_t x = ( i + 1 ) * 0x9e3779b97f4a7c15ULL + seed;
+        x ^= x >> 29;
+        return (uint8_t)( x * 0xbf58476d1ce4e5b9ULL >> 56 );
+    }
+
+    struct Endpoint {
+        int fd;
+        uint32_t out;               // seed of the stream written
+        uint32_t in;                // seed of the stream read
+        uint64_t received;
+        bool intact;
+    };
+
+    void *writer( void *arg ) {
+        Endpoint *e = (Endpoint *)arg;
+        unsigned int r = e->out;
+        char buffer[8192];
+        uint64_t sent = 0;
+        while ( sent < total ) {
+            uint64_t n = 1 + rand_r(&r) % sizeof(buffer);
+            if ( n > total - sent ) n = total - sent;
+            for ( uint64_t i = 0 ; i < n ; i++ ) buffer[i] = expected( e->out, sent + i );
+            ssize_t w = write( e->fd, buffer, n );
+            if ( w <= 0 ) break;
+            sent += w;
+        }
+        shutdown( e->fd, SHUT_WR );
+        return 0;
+    }
+
+    void *reader( void *arg ) {
+        Endpoint *e = (Endpoint *)arg;
+        unsigned int r = e->in;
+        char buffer[16384];
+        e->intact = true;
+        for (;;) {
+            if ( rand_r(&r) % 64 == 0 ) usleep( 200 );
+            ssize_t n = read( e->fd, buffer, 1 + rand_r(&r) % sizeof(buffer) );
+            if ( n <= 0 ) break;
+            for ( ssize_t i = 0 ; i < n ; i++ ) {
+                if ( (uint8_t)buffer[i] != expected(e->in, e->received + i) ) e->intact = false;
+            }
+            e->received += n;
+        }
+        return 0;
+    }
+
+    void pumped( SpliceTunnel& tunnel ) {
+        SpliceTunnel::Direction *d[2] = { &tunnel.upstream, &tunnel.downstream };
+        while ( tunnel.done() == false ) {
+            struct pollfd p[4];
+            for ( int i = 0 ; i < 2 ; i++ ) {
+                p[2*i].fd = d[i]->from;
+                p[2*i].events = tunnel.wantsRead(*d[i]) ? POLLIN : 0;
+                p[2*i+1].fd = d[i]->to;
+                p[2*i+1].events = tunnel.wantsWrite(*d[i]) ? POLLOUT : 0;
+            }
+            poll( p, 4, 100 );
+            for ( int i = 0 ; i < 2 ; i++ ) {
+                if ( tunnel.pump(*d[i]) == SpliceTunnel::ERROR ) {
+                    fprintf( stderr, "pump: errno %d\n", errno );
+                    return;
+                }
+            }
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    void ringed( SpliceTunnel& tunnel ) {
+        SpliceRing ring( 16 );
+        if ( ring.valid() == false ) {
+            fprintf( stderr, "ring: io_uring not available\n" );
+            return;
+        }
+        SpliceTunnel::Direction *d[2] = { &tunnel.upstream, &tunnel.downstream };
+        for ( int i = 0 ; i < 2 ; i++ ) tunnel.submit( ring, *d[i], i * 4 );
+        while ( tunnel.done() == false ) {
+            if ( ring.submit(1) < 0 && errno != EINTR ) {
+                fprintf( stderr, "ring: io_uring_enter errno %d\n", errno );
+                return;
+            }
+            uintptr_t data;
+            int result;
+            while ( ring.reap(&data, &result) ) {
+                SpliceTunnel::Direction& which = *d[data >> 2];
+                if ( tunnel.complete(which, data, result) == SpliceTunnel::ERROR ) {
+                    fprintf( stderr, "ring: request %lu failed %d\n", (unsigned long)data, result );
+                    return;
+                }
+                tunnel.submit( ring, which, data & ~(uintptr_t)3 );
+            }
+        }
+    }
+#endif
+
+    double seconds() {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    bool trial( const char *name, void (*drive)(SpliceTunnel&) ) {
+        int client[2], server[2];
+        if ( socketpair(AF_UNIX, SOCK_STREAM, 0, client) != 0 ) return false;
+        if ( socketpair(AF_UNIX, SOCK_STREAM, 0, server) != 0 ) return false;
+        fcntl( client[1], F_SETFL, O_NONBLOCK );
+        fcntl( server[0], F_SETFL, O_NONBLOCK );
+
+        Endpoint c = { client[0], 1, 2, 0, false };
+        Endpoint s = { server[1], 2, 1, 0, false };
+        SpliceTunnel tunnel( client[1], server[0] );
+        if ( tunnel.valid() == false ) return false;
+
+        double start = seconds();
+        pthread_t t[4];
+        pthread_create( &t[0], NULL, writer, &c );
+        pthread_create( &t[1], NULL, writer, &s );
+        pthread_create( &t[2], NULL, reader, &c );
+        pthread_create( &t[3], NULL, reader, &s );
+        drive( tunnel );
+        for ( int i = 0 ; i < 4 ; i++ ) pthread_join( t[i], NULL );
+        double elapsed = seconds() - start;
+
+        bool ok = tunnel.done() && c.intact && s.intact &&
+                  c.received == total && s.received == total;
+        printf( "%-6s %s  %.0f MB/s  up %llu down %llu\n", name, ok ? "ok    " : "FAILED",
+                2 * total / elapsed / 1e6,
+                (unsigned long long)tunnel.upstream.bytes,
+                (unsigned long long)tunnel.downstream.bytes );
+        for ( int i = 0 ; i < 2 ; i++ ) {
+            close( client[i] );
+            close( server[i] );
+        }
+        return ok;
+    }
+}
+
+int
+main( int argc, char **argv ) {
+    total = (uint64_t)( argc > 1 ? atoi(argv[1]) : 64 ) << 20;
+    bool ok = trial( "pump", pumped );
+#ifdef HAVE_IO_URING
+    ok = trial( "ring", ringed ) && ok;
+#endif
+    return ok ? 0 : 1;
+}
+
+/* vim: set autoindent expandtab sw=4 : */